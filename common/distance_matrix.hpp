@@ -0,0 +1,190 @@
+#ifndef IMPL_DISTANCE_MATRIX_HPP
+#define IMPL_DISTANCE_MATRIX_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "exceptions.hpp"
+
+
+/**
+ * Contiguous row-major n x n matrix of distances.
+ * The cell width (1, 2 or 4 bytes) is chosen from an upper bound on the largest stored distance.
+ * The all-ones cell value marks unreachable pairs, which are reported as -1.
+ * The cells are either owned or a read-only memory mapping of a file written by save().
+ */
+class distance_matrix {
+private:
+	struct file_header {
+		char magic[8];
+		uint64_t key;
+		int32_t n;
+		int32_t cell_size;
+	};
+
+	static constexpr char file_magic[8] = {'M', 'E', 'S', 'P', 'D', 'S', 'T', '1'};
+
+	int n = 0;
+	int cell_size = 0;
+	std::vector<uint8_t> cells;
+	const uint8_t *data = nullptr;
+	std::shared_ptr<void> mapping;
+
+public:
+	void reset(int vertices, int max_distance)
+	{
+		n = vertices;
+		if (max_distance < std::numeric_limits<uint8_t>::max()) {
+			cell_size = sizeof(uint8_t);
+		} else if (max_distance < std::numeric_limits<uint16_t>::max()) {
+			cell_size = sizeof(uint16_t);
+		} else {
+			cell_size = sizeof(int32_t);
+		}
+		mapping.reset();
+		cells.assign((size_t) n * n * cell_size, 0xff);
+		data = cells.data();
+	}
+
+
+	bool empty() const
+	{
+		return data == nullptr || n == 0;
+	}
+
+
+	/**
+	 * Maps a matrix stored by save() with the same key. Returns false if the file is missing or does not match.
+	 */
+	bool map(const std::string &filename, uint64_t key, int vertices)
+	{
+		int fd = ::open(filename.c_str(), O_RDONLY);
+		if (fd == -1) return false;
+		struct stat st;
+		file_header header;
+		bool valid = fstat(fd, &st) == 0
+			&& pread(fd, &header, sizeof(header), 0) == sizeof(header)
+			&& memcmp(header.magic, file_magic, sizeof(file_magic)) == 0
+			&& header.key == key
+			&& header.n == vertices
+			&& (header.cell_size == 1 || header.cell_size == 2 || header.cell_size == 4)
+			&& (size_t) st.st_size == sizeof(header) + (size_t) vertices * vertices * header.cell_size;
+		void *addr = valid ? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+		::close(fd);
+		if (addr == MAP_FAILED) return false;
+		size_t length = st.st_size;
+		mapping = std::shared_ptr<void>(addr, [length] (void *p) { munmap(p, length); });
+		cells.clear();
+		cells.shrink_to_fit();
+		n = vertices;
+		cell_size = header.cell_size;
+		data = (const uint8_t *) addr + sizeof(header);
+		return true;
+	}
+
+
+	/**
+	 * Writes the matrix to a temporary file renamed into place, so that concurrent readers never map a partial file.
+	 */
+	void save(const std::string &filename, uint64_t key) const
+	{
+		std::string tmp = filename + ".tmp" + std::to_string(getpid());
+		FILE *f = fopen(tmp.c_str(), "wb");
+		if (f == nullptr) throw open_file_exception(tmp, strerror(errno));
+		file_header header = {};
+		memcpy(header.magic, file_magic, sizeof(file_magic));
+		header.key = key;
+		header.n = n;
+		header.cell_size = cell_size;
+		size_t length = (size_t) n * n * cell_size;
+		bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(data, 1, length, f) == length;
+		ok = fclose(f) == 0 && ok;
+		if (!ok || rename(tmp.c_str(), filename.c_str()) != 0) {
+			std::string reason = strerror(errno);
+			remove(tmp.c_str());
+			throw open_file_exception(filename, reason);
+		}
+	}
+
+
+	int size() const
+	{
+		return n;
+	}
+
+
+	int cell_bytes() const
+	{
+		return cell_size;
+	}
+
+
+	template<typename Cell>
+	static constexpr Cell unreachable()
+	{
+		return (Cell) ~(Cell) 0;
+	}
+
+
+	template<typename Cell>
+	const Cell * row(int u) const
+	{
+		return reinterpret_cast<const Cell *>(data) + (size_t) u * n;
+	}
+
+
+	template<typename Cell>
+	Cell * row(int u)
+	{
+		return reinterpret_cast<Cell *>(cells.data()) + (size_t) u * n;
+	}
+
+
+	int get(int u, int v) const
+	{
+		switch (cell_size) {
+			case sizeof(uint8_t):
+				return cell_value(row<uint8_t>(u)[v]);
+			case sizeof(uint16_t):
+				return cell_value(row<uint16_t>(u)[v]);
+			default:
+				return cell_value(row<int32_t>(u)[v]);
+		}
+	}
+
+
+	/**
+	 * Calls f with a null pointer of the current cell type, so that row loops can be instantiated per width.
+	 */
+	template<typename F>
+	decltype(auto) visit(F &&f) const
+	{
+		switch (cell_size) {
+			case sizeof(uint8_t):
+				return f((uint8_t *) nullptr);
+			case sizeof(uint16_t):
+				return f((uint16_t *) nullptr);
+			default:
+				return f((int32_t *) nullptr);
+		}
+	}
+
+
+private:
+	template<typename Cell>
+	static int cell_value(Cell d)
+	{
+		return d == unreachable<Cell>() ? -1 : (int) d;
+	}
+};
+
+
+#endif //IMPL_DISTANCE_MATRIX_HPP
@@ -0,0 +1,124 @@
+#ifndef IMPL_DISTANCE_ORACLE_HPP
+#define IMPL_DISTANCE_ORACLE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+
+/**
+ * Exact distances without the n x n matrix.
+ * Keeps BFS rows of recently queried vertices in a bounded LRU cache split into independently locked shards
+ * and computes missing rows on demand.
+ */
+class distance_oracle {
+public:
+	typedef std::vector<int> row_type;
+	typedef std::function<void(int, row_type &)> row_function;
+
+private:
+	static constexpr int shard_count = 16;
+
+	struct shard {
+		std::mutex mtx;
+		std::list<int> recent;
+		std::unordered_map<int, std::pair<std::shared_ptr<const row_type>, std::list<int>::iterator>> rows;
+	};
+
+	int n;
+	size_t rows_per_shard;
+	row_function compute_row;
+	std::unique_ptr<shard[]> shards;
+	std::atomic<long long> cnt_hits{0};
+	std::atomic<long long> cnt_misses{0};
+
+public:
+	distance_oracle(int n, size_t memory_budget, row_function compute_row):
+		n(n),
+		compute_row(std::move(compute_row)),
+		shards(new shard[shard_count])
+	{
+		size_t row_bytes = std::max<size_t>(1, (size_t) n * sizeof(int));
+		rows_per_shard = std::max<size_t>(1, memory_budget / row_bytes / shard_count);
+	}
+
+
+	/**
+	 * Uses a cached row of u or v if there is one, otherwise computes and caches the row of v.
+	 * Callers should pass the vertex that is queried repeatedly (modulator, path endpoints) as v.
+	 */
+	int get(int u, int v)
+	{
+		if (auto r = find(u)) {
+			cnt_hits++;
+			return (*r)[v];
+		}
+		return (*row(v))[u];
+	}
+
+
+	std::shared_ptr<const row_type> row(int v)
+	{
+		if (auto r = find(v)) {
+			cnt_hits++;
+			return r;
+		}
+		cnt_misses++;
+		auto r = std::make_shared<row_type>(n, -1);
+		compute_row(v, *r);
+		shard &s = shard_of(v);
+		std::lock_guard<std::mutex> lock(s.mtx);
+		if (s.rows.count(v)) return s.rows[v].first;
+		s.recent.push_front(v);
+		s.rows[v] = {r, s.recent.begin()};
+		if (s.rows.size() > rows_per_shard) {
+			s.rows.erase(s.recent.back());
+			s.recent.pop_back();
+		}
+		return r;
+	}
+
+
+	long long hits() const
+	{
+		return cnt_hits;
+	}
+
+
+	long long misses() const
+	{
+		return cnt_misses;
+	}
+
+
+	size_t capacity() const
+	{
+		return rows_per_shard * shard_count;
+	}
+
+
+private:
+	shard & shard_of(int v)
+	{
+		return shards[v % shard_count];
+	}
+
+
+	std::shared_ptr<const row_type> find(int v)
+	{
+		shard &s = shard_of(v);
+		std::lock_guard<std::mutex> lock(s.mtx);
+		auto it = s.rows.find(v);
+		if (it == s.rows.end()) return nullptr;
+		s.recent.splice(s.recent.begin(), s.recent, it->second.second);
+		return it->second.first;
+	}
+};
+
+
+#endif //IMPL_DISTANCE_ORACLE_HPP
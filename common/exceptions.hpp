@@ -81,6 +81,23 @@ public:
 };
 
 
+class write_file_exception : public presentable_exception {
+private:
+	std::string filename;
+	std::string reason;
+
+public:
+	write_file_exception(const std::string &filename, const std::string &reason):
+		filename(filename),
+		reason(reason)
+	{}
+
+	std::string message() const noexcept override {
+		return "Failed to write file `" + filename + "`: " + reason;
+	}
+};
+
+
 class implementation_exception : std::exception {};
 
 
@@ -2,10 +2,78 @@
 #define IMPL_GRAPH_HPP
 
 #include <algorithm>
+#include <boost/asio/post.hpp>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
 #include <queue>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 #include "common.hpp"
+#include "distance_matrix.hpp"
+#include "distance_oracle.hpp"
 #include "graph.hpp"
+#include "multi_source_bfs.hpp"
+
+
+enum class apsp_backend {
+	automatic,
+	bfs,
+	bit_parallel,
+};
+
+
+apsp_backend parse_apsp_backend(const std::string &value)
+{
+	if (value == "auto") return apsp_backend::automatic;
+	if (value == "bfs") return apsp_backend::bfs;
+	if (value == "bit-parallel") return apsp_backend::bit_parallel;
+	throw invalid_argument_exception("distance backend", value, "Must be one of `auto`, `bfs`, `bit-parallel`.");
+}
+
+
+/**
+ * Read-only view of the neighbors of one vertex in the compressed adjacency array.
+ */
+class neighbor_range {
+private:
+	const int *first;
+	const int *last;
+
+public:
+	neighbor_range(const int *first, const int *last):
+		first(first),
+		last(last)
+	{}
+
+
+	const int * begin() const
+	{
+		return first;
+	}
+
+
+	const int * end() const
+	{
+		return last;
+	}
+
+
+	size_t size() const
+	{
+		return last - first;
+	}
+
+
+	int operator[](size_t i) const
+	{
+		return first[i];
+	}
+};
 
 
 class graph {
@@ -13,54 +81,233 @@ public:
 	const int n;
 
 private:
-	std::vector<std::vector<int>> neighborhood;
-	std::vector<std::vector<int>> distances;
+	std::vector<std::pair<int, int>> edge_list;
+	std::vector<int> offsets;
+	std::vector<int> edges;
+	distance_matrix distances;
+	std::unique_ptr<distance_oracle> oracle;
 
 
 public:
 	explicit graph(int n):
-		n(n)
+		n(n),
+		offsets(n + 1, 0)
+	{}
+
+
+	/**
+	 * Graph with an already built compressed sparse row adjacency.
+	 */
+	graph(int n, std::vector<int> &&offsets, std::vector<int> &&edges):
+		n(n),
+		offsets(std::move(offsets)),
+		edges(std::move(edges))
+	{}
+
+
+	/**
+	 * Edges are collected until freeze() builds the compressed sparse row adjacency.
+	 */
+	void add_edge(int u, int v)
 	{
-		neighborhood.resize(n);
+		edge_list.emplace_back(u, v);
 	}
 
 
-	void add_edge(int u, int v)
+	/**
+	 * Builds the compressed sparse row adjacency. Edges added after a previous freeze() are appended to it.
+	 */
+	void freeze()
 	{
-		neighborhood[u].push_back(v);
-		neighborhood[v].push_back(u);
+		std::vector<int> new_offsets(n + 1, 0);
+		for (int u = 0; u < n && !offsets.empty(); u++) {
+			new_offsets[u + 1] = offsets[u + 1] - offsets[u];
+		}
+		for (auto [u, v] : edge_list) {
+			new_offsets[u + 1]++;
+			new_offsets[v + 1]++;
+		}
+		for (int u = 0; u < n; u++) {
+			new_offsets[u + 1] += new_offsets[u];
+		}
+		std::vector<int> new_edges(new_offsets[n]);
+		std::vector<int> pos(new_offsets.begin(), new_offsets.end() - 1);
+		for (int u = 0; u < n && !offsets.empty(); u++) {
+			for (int v : neighbors(u)) new_edges[pos[u]++] = v;
+		}
+		for (auto [u, v] : edge_list) {
+			new_edges[pos[u]++] = v;
+			new_edges[pos[v]++] = u;
+		}
+		offsets = std::move(new_offsets);
+		edges = std::move(new_edges);
+		edge_list.clear();
+		edge_list.shrink_to_fit();
 	}
 
 
-	void calculate_distances()
+	/**
+	 * Copy of the graph with vertex order[i] renamed to i. Distances are not copied.
+	 */
+	std::shared_ptr<graph> relabeled(const std::vector<int> &order) const
 	{
-		distances.resize(n, std::vector<int>(n, -1));
-		for (int i = 0; i < n; i++) {
-			distances[i][i] = 0;
-			std::queue<int> q;
-			q.push(i);
-			while (!q.empty()) {
-				int u = q.front();
-				q.pop();
-				for (int v : neighbors(u)) {
-					if (distances[i][v] != -1) continue;
-					distances[i][v] = distances[i][u] + 1;
-					q.push(v);
-				}
+		std::vector<int> new_id(n);
+		for (int i = 0; i < n; i++) new_id[order[i]] = i;
+		auto res = std::make_shared<graph>(n);
+		for (int u = 0; u < n; u++) {
+			for (int v : neighbors(u)) {
+				if (u < v) res->add_edge(new_id[u], new_id[v]);
 			}
 		}
+		res->freeze();
+		return res;
+	}
+
+
+	void calculate_distances(apsp_backend backend = apsp_backend::automatic)
+	{
+		std::vector<int> queue;
+		bool bit_parallel = prepare_distances(backend, queue);
+		for (int first = 0; first < n; first += default_bit_lanes::size) {
+			fill_distances(first, bit_parallel, queue);
+		}
+	}
+
+
+	/**
+	 * Runs the all-pairs BFS on the given executor, split into blocks of source vertices.
+	 * Blocks until all rows are filled. Must not be called from a worker of the same executor.
+	 */
+	template<typename Executor>
+	void calculate_distances(Executor &pool, apsp_backend backend = apsp_backend::automatic)
+	{
+		constexpr int block_size = default_bit_lanes::size;
+		std::vector<int> queue;
+		bool bit_parallel = prepare_distances(backend, queue);
+		int blocks = (n + block_size - 1) / block_size;
+		std::mutex mtx;
+		std::condition_variable finished;
+		int cnt_finished = 0;
+		for (int b = 0; b < blocks; b++) {
+			boost::asio::post(pool, [this, b, blocks, bit_parallel, &mtx, &finished, &cnt_finished] () {
+				thread_local std::vector<int> worker_queue;
+				fill_distances(b * block_size, bit_parallel, worker_queue);
+				std::lock_guard<std::mutex> lock(mtx);
+				if (++cnt_finished == blocks) finished.notify_one();
+			});
+		}
+		std::unique_lock<std::mutex> lock(mtx);
+		finished.wait(lock, [&cnt_finished, blocks] { return cnt_finished == blocks; });
+	}
+
+
+	/**
+	 * Like calculate_distances(pool, backend), but first tries to map a matrix stored in cache_dir
+	 * for a graph with the same content hash, and stores the computed matrix there otherwise.
+	 */
+	template<typename Executor>
+	void calculate_distances(Executor &pool, apsp_backend backend, const std::string &cache_dir)
+	{
+		std::string filename = cache_dir + "/" + distance_cache_name();
+		if (distances.map(filename, content_hash(), n)) return;
+		calculate_distances(pool, backend);
+		distances.save(filename, content_hash());
+	}
+
+
+	/**
+	 * FNV-1a hash of the vertex count and the adjacency arrays.
+	 */
+	uint64_t content_hash() const
+	{
+		uint64_t res = 14695981039346656037ull;
+		auto add = [&res] (int x) {
+			for (int i = 0; i < 4; i++) {
+				res ^= (x >> (8 * i)) & 0xff;
+				res *= 1099511628211ull;
+			}
+		};
+		add(n);
+		for (int x : offsets) add(x);
+		for (int x : edges) add(x);
+		return res;
+	}
+
+
+	/**
+	 * Answers distance queries from a bounded cache of BFS rows instead of the full matrix.
+	 */
+	void use_distance_oracle(size_t memory_budget)
+	{
+		oracle = std::make_unique<distance_oracle>(n, memory_budget, [this] (int s, distance_oracle::row_type &row) {
+			thread_local std::vector<int> queue;
+			bfs_row(s, row.data(), queue);
+		});
+	}
+
+
+	const distance_oracle * distance_cache() const
+	{
+		return oracle.get();
+	}
+
+
+	const std::vector<int> & adjacency_offsets() const
+	{
+		return offsets;
+	}
+
+
+	const std::vector<int> & adjacency() const
+	{
+		return edges;
 	}
 
 
-	const std::vector<int> & neighbors(int u) const
+	neighbor_range neighbors(int u) const
 	{
-		return neighborhood[u];
+		return {edges.data() + offsets[u], edges.data() + offsets[u + 1]};
 	}
 
 
 	int distance(int u, int v) const
 	{
-		return distances[u][v];
+		if (oracle) return oracle->get(u, v);
+		return distances.get(u, v);
+	}
+
+
+	bool has_distance_matrix() const
+	{
+		return !distances.empty();
+	}
+
+
+	/**
+	 * max_u d(u, a) + d(u, b) - d(a, b) over vertices u reachable from both a and b, computed from the matrix rows.
+	 * Every vertex is at distance at least half of this from any shortest a-b path.
+	 * The sweep stops early once the result exceeds stop_above, returning some value larger than it.
+	 */
+	int max_detour(int a, int b, int stop_above = INF) const
+	{
+		return distances.visit([this, a, b, stop_above] (auto *cell_type) {
+			using Cell = std::make_unsigned_t<std::remove_pointer_t<decltype(cell_type)>>;
+			constexpr int block_size = 256;
+			constexpr Cell unreachable = distance_matrix::unreachable<Cell>();
+			const Cell *__restrict row_a = distances.row<Cell>(a);
+			const Cell *__restrict row_b = distances.row<Cell>(b);
+			int d = distance(a, b);
+			uint32_t res = 0;
+			for (int first = 0; first < n; first += block_size) {
+				int last = std::min(n, first + block_size);
+				for (int v = first; v < last; v++) {
+					uint32_t sum = (uint32_t) row_a[v] + row_b[v];
+					res = std::max(res, row_a[v] == unreachable || row_b[v] == unreachable ? 0 : sum);
+				}
+				if ((long long) res - d > stop_above) break;
+			}
+			return (int) res - d;
+		});
 	}
 
 
@@ -76,6 +323,47 @@ public:
 	}
 
 
+	/**
+	 * Sets res[u] to the distance from u to the closest vertex of S, or INF if S is unreachable from u.
+	 * With the distance matrix this is a min-reduction over the rows of S, otherwise a single multi-source BFS.
+	 */
+	template<typename Container>
+	void distance_to_set(const Container &S, std::vector<int> &res) const
+	{
+		static_assert(std::is_same<typename Container::value_type, int>::value);
+		res.assign(n, INF);
+		if (distances.empty()) {
+			thread_local std::vector<int> queue;
+			queue.clear();
+			for (int s : S) {
+				if (res[s] == 0) continue;
+				res[s] = 0;
+				queue.push_back(s);
+			}
+			for (size_t head = 0; head < queue.size(); head++) {
+				int u = queue[head];
+				for (int v : neighbors(u)) {
+					if (res[v] != INF) continue;
+					res[v] = res[u] + 1;
+					queue.push_back(v);
+				}
+			}
+			return;
+		}
+		distances.visit([this, &S, &res] (auto *cell_type) {
+			using Cell = std::make_unsigned_t<std::remove_pointer_t<decltype(cell_type)>>;
+			thread_local std::vector<Cell> acc;
+			acc.assign(n, distance_matrix::unreachable<Cell>());
+			for (int s : S) {
+				min_into(acc.data(), distances.row<Cell>(s), n);
+			}
+			for (int v = 0; v < n; v++) {
+				if (acc[v] != distance_matrix::unreachable<Cell>()) res[v] = acc[v];
+			}
+		});
+	}
+
+
 	int ecc(const std::vector<int> &S) const {
 		std::queue<int> q;
 		std::vector<int> dst(n, -1);
@@ -97,6 +385,166 @@ public:
 		return res;
 	}
 
+
+	/**
+	 * Same as ecc(S) <= k, but the BFS stops as soon as a vertex at distance k + 1 is found.
+	 * Uses thread-local scratch with epoch-stamped visited marks, so it does not allocate after warm-up.
+	 */
+	bool ecc_at_most(const std::vector<int> &S, int k) const
+	{
+		thread_local std::vector<unsigned> visited;
+		thread_local unsigned epoch = 0;
+		thread_local std::vector<int> queue;
+		if ((int) visited.size() < n) {
+			visited.assign(n, 0);
+			epoch = 0;
+		}
+		if (++epoch == 0) {
+			std::fill(visited.begin(), visited.end(), 0);
+			epoch = 1;
+		}
+		queue.clear();
+		for (int u : S) {
+			if (visited[u] == epoch) continue;
+			visited[u] = epoch;
+			queue.push_back(u);
+		}
+		size_t head = 0;
+		for (int depth = 0; head < queue.size(); depth++) {
+			size_t level_end = queue.size();
+			for (; head < level_end; head++) {
+				for (int v : neighbors(queue[head])) {
+					if (visited[v] == epoch) continue;
+					if (depth == k) return false;
+					visited[v] = epoch;
+					queue.push_back(v);
+				}
+			}
+		}
+		return true;
+	}
+
+
+	/**
+	 * Eccentricities of many vertex sets at once, computed by the bit-parallel BFS kernel.
+	 */
+	std::vector<int> ecc(const std::vector<path> &sets) const
+	{
+		std::vector<int> res(sets.size(), 0);
+		for (size_t first = 0; first < sets.size(); first += default_bit_lanes::size) {
+			std::vector<path> lane_sources(
+				sets.begin() + first,
+				sets.begin() + std::min(sets.size(), first + default_bit_lanes::size)
+			);
+			multi_source_bfs<default_bit_lanes>(*this, lane_sources, [&res, first] (int, const default_bit_lanes &lanes, int level) {
+				lanes.for_each([&res, first, level] (int i) { res[first + i] = level; });
+			});
+		}
+		return res;
+	}
+
+
+private:
+	std::string distance_cache_name() const
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.dist", (unsigned long long) content_hash());
+		return name;
+	}
+
+
+	/**
+	 * Allocates the distance matrix and decides whether to use the bit-parallel kernel.
+	 * The automatic choice prefers it when the distance bound is small compared to the number of lanes,
+	 * since it makes one pass over all edges per BFS level for a whole block of sources.
+	 */
+	bool prepare_distances(apsp_backend backend, std::vector<int> &queue)
+	{
+		int bound = distance_bound(queue);
+		distances.reset(n, bound);
+		switch (backend) {
+			case apsp_backend::bfs:
+				return false;
+			case apsp_backend::bit_parallel:
+				return true;
+			default:
+				return bound < 64;
+		}
+	}
+
+
+	void fill_distances(int first, bool bit_parallel, std::vector<int> &queue)
+	{
+		int last = std::min(n, first + default_bit_lanes::size);
+		distances.visit([this, first, last, bit_parallel, &queue] (auto *cell_type) {
+			using Cell = std::remove_pointer_t<decltype(cell_type)>;
+			if (!bit_parallel) {
+				for (int i = first; i < last; i++) {
+					bfs_row(i, distances.row<Cell>(i), queue);
+				}
+				return;
+			}
+			std::vector<std::vector<int>> lane_sources;
+			lane_sources.reserve(last - first);
+			for (int i = first; i < last; i++) lane_sources.push_back({i});
+			multi_source_bfs<default_bit_lanes>(*this, lane_sources, [this, first] (int v, const default_bit_lanes &lanes, int level) {
+				lanes.for_each([this, first, v, level] (int i) { distances.row<Cell>(first + i)[v] = level; });
+			});
+		});
+	}
+
+
+	/**
+	 * Upper bound on the largest finite distance, used to pick the matrix cell width.
+	 * For a connected graph the diameter is at most twice the eccentricity of any vertex.
+	 */
+	int distance_bound(std::vector<int> &queue) const
+	{
+		if (n == 0) return 0;
+		std::vector<int> dst(n, -1);
+		queue.assign(1, 0);
+		dst[0] = 0;
+		for (size_t head = 0; head < queue.size(); head++) {
+			int u = queue[head];
+			for (int v : neighbors(u)) {
+				if (dst[v] != -1) continue;
+				dst[v] = dst[u] + 1;
+				queue.push_back(v);
+			}
+		}
+		if ((int) queue.size() < n) return n - 1;
+		return std::min(n - 1, 2 * dst[queue.back()]);
+	}
+
+
+	/**
+	 * Element-wise minimum over unsigned cells, so unreachable (all ones) compares as the largest value.
+	 * Written as a plain loop over restrict pointers for the compiler to vectorize.
+	 */
+	template<typename Cell>
+	static void min_into(Cell *__restrict acc, const Cell *__restrict row, int n)
+	{
+		for (int v = 0; v < n; v++) {
+			acc[v] = std::min(acc[v], row[v]);
+		}
+	}
+
+
+	template<typename Cell>
+	void bfs_row(int s, Cell *row, std::vector<int> &queue) const
+	{
+		row[s] = 0;
+		queue.assign(1, s);
+		for (size_t head = 0; head < queue.size(); head++) {
+			int u = queue[head];
+			for (int v : neighbors(u)) {
+				if (row[v] != distance_matrix::unreachable<Cell>()) continue;
+				row[v] = row[u] + 1;
+				queue.push_back(v);
+			}
+		}
+	}
+
 };
 
 
@@ -1,9 +1,13 @@
 #ifndef IMPL_INPUT_HPP
 #define IMPL_INPUT_HPP
 
+#include <cctype>
 #include <cstring>
 #include <boost/filesystem.hpp>
 #include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <unordered_set>
 #include <vector>
@@ -37,6 +41,18 @@ public:
 			fclose(stream);
 		}
 	}
+
+
+	/**
+	 * Closes the file before it is destroyed. Returns false if some of the output could not be written.
+	 */
+	bool close()
+	{
+		if (!do_close) return true;
+		do_close = false;
+		bool written = fflush(stream) == 0 && !ferror(stream);
+		return fclose(stream) == 0 && written;
+	}
 };
 
 
@@ -66,30 +82,126 @@ public:
 	{}
 
 
+	/**
+	 * Buffered output; call flush() once the whole result is written.
+	 */
 	template<typename...Ts>
 	int print(const std::string &format, Ts&&...params) const
 	{
-		int res = fprintf(f->stream, format.c_str(), std::forward<Ts>(params)...);
-		fflush(f->stream);
-		return res;
+		return fprintf(f->stream, format.c_str(), std::forward<Ts>(params)...);
 	}
 
 
+	/**
+	 * Progress output, flushed immediately.
+	 */
 	template<typename...Ts>
 	int print_tty(const std::string &format, Ts&&...params) const
 	{
 		if (isatty(fileno(f->stream))) {
-			return print(format, std::forward<Ts>(params)...);
+			int res = print(format, std::forward<Ts>(params)...);
+			flush();
+			return res;
 		}
 		return 0;
 	}
 
+
+	size_t write(const void *data, size_t size) const
+	{
+		return fwrite(data, 1, size, f->stream);
+	}
+
+
+	void flush() const
+	{
+		fflush(f->stream);
+	}
+
+};
+
+
+/**
+ * Whole remaining content of a file, memory-mapped for regular files and read into memory otherwise,
+ * consumed by a cursor.
+ */
+class input_buffer {
+private:
+	std::string data;
+	std::shared_ptr<void> mapping;
+	const char *pos = nullptr;
+	const char *end = nullptr;
+
+public:
+	explicit input_buffer(FILE *stream)
+	{
+		int fd = fileno(stream);
+		struct stat st;
+		long offset = ftell(stream);
+		if (offset >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > offset) {
+			size_t length = st.st_size;
+			void *addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (addr != MAP_FAILED) {
+				mapping = std::shared_ptr<void>(addr, [length] (void *p) { munmap(p, length); });
+				pos = (const char *) addr + offset;
+				end = (const char *) addr + length;
+				fseek(stream, 0, SEEK_END);
+				return;
+			}
+		}
+		char chunk[1 << 16];
+		size_t cnt;
+		while ((cnt = fread(chunk, 1, sizeof(chunk), stream)) > 0) {
+			data.append(chunk, cnt);
+		}
+		pos = data.data();
+		end = data.data() + data.size();
+	}
+
+
+	/**
+	 * Parses the next decimal integer after whitespace, like fscanf("%d") but without the per-call overhead.
+	 */
+	bool next_int(int &x)
+	{
+		while (pos < end && isspace((unsigned char) *pos)) pos++;
+		bool negative = pos < end && *pos == '-';
+		if (negative || (pos < end && *pos == '+')) pos++;
+		if (pos == end || !isdigit((unsigned char) *pos)) return false;
+		long long res = 0;
+		while (pos < end && isdigit((unsigned char) *pos)) {
+			res = res * 10 + (*pos - '0');
+			if (res > INF) return false;
+			pos++;
+		}
+		x = (int) (negative ? -res : res);
+		return true;
+	}
+
+
+	bool starts_with(const char *prefix, size_t size) const
+	{
+		return (size_t) (end - pos) >= size && memcmp(pos, prefix, size) == 0;
+	}
+
+
+	/**
+	 * Returns the next size raw bytes and skips them, or nullptr if there are not enough.
+	 */
+	const char * take(size_t size)
+	{
+		if ((size_t) (end - pos) < size) return nullptr;
+		const char *res = pos;
+		pos += size;
+		return res;
+	}
 };
 
 
 class reader {
 private:
 	std::shared_ptr<const file> f;
+	mutable std::shared_ptr<input_buffer> buffer;
 
 public:
 	reader(std::shared_ptr<const file> f):
@@ -102,31 +214,96 @@ public:
 	{
 		return fscanf(f->stream, format, std::forward<Ts>(params)...);
 	}
+
+
+	/**
+	 * Buffered input used by the graph and modulator parsers. Once used, scan() must not be called on the same file.
+	 */
+	input_buffer & buffered() const
+	{
+		if (!buffer) buffer = std::make_shared<input_buffer>(f->stream);
+		return *buffer;
+	}
 };
 
 
+const char graph_binary_magic[8] = {'M', 'E', 'S', 'P', 'G', 'R', 'F', '1'};
+
+
+/**
+ * Binary graph format: magic, vertex count, adjacency length, then the CSR offsets and adjacency as 32-bit integers.
+ */
+std::shared_ptr<graph> read_graph_binary(input_buffer &in)
+{
+	in.take(sizeof(graph_binary_magic));
+	const char *header = in.take(2 * sizeof(int32_t));
+	if (header == nullptr) throw graph_input_exception();
+	int32_t n, m;
+	memcpy(&n, header, sizeof(n));
+	memcpy(&m, header + sizeof(n), sizeof(m));
+	if (n < 0 || m < 0) throw graph_input_exception();
+	std::vector<int> offsets(n + 1);
+	std::vector<int> edges(m);
+	const char *data = in.take(offsets.size() * sizeof(int32_t));
+	if (data == nullptr) throw graph_input_exception();
+	memcpy(offsets.data(), data, offsets.size() * sizeof(int32_t));
+	data = in.take(edges.size() * sizeof(int32_t));
+	if (data == nullptr) throw graph_input_exception();
+	memcpy(edges.data(), data, edges.size() * sizeof(int32_t));
+	if (offsets[0] != 0 || offsets[n] != m) throw graph_input_exception();
+	for (int u = 0; u < n; u++) {
+		if (offsets[u] > offsets[u + 1]) throw graph_input_exception();
+	}
+	for (int v : edges) {
+		if (v < 0 || v >= n) throw graph_input_exception();
+	}
+	return std::make_shared<graph>(n, std::move(offsets), std::move(edges));
+}
+
+
+/**
+ * Reads the text edge list format, or the binary format if the input starts with its magic.
+ */
 std::shared_ptr<graph> read_graph(const reader &r)
 {
+	input_buffer &in = r.buffered();
+	if (in.starts_with(graph_binary_magic, sizeof(graph_binary_magic))) {
+		return read_graph_binary(in);
+	}
 	int n, m;
-	if (r.scan("%d %d", &n, &m) != 2) throw graph_input_exception();
+	if (!in.next_int(n) || !in.next_int(m) || n < 0 || m < 0) throw graph_input_exception();
 	auto G = std::make_shared<graph>(n);
 	for (int i = 0; i < m; i++) {
 		int u, v;
-		if (r.scan("%d %d", &u, &v) != 2) throw graph_input_exception();
+		if (!in.next_int(u) || !in.next_int(v)) throw graph_input_exception();
+		if (u < 0 || u >= n || v < 0 || v >= n) throw graph_input_exception();
 		G->add_edge(u, v);
 	}
+	G->freeze();
 	return G;
 }
 
 
+void write_graph_binary(const graph &G, const writer &w)
+{
+	int32_t header[2] = {G.n, (int32_t) G.adjacency().size()};
+	w.write(graph_binary_magic, sizeof(graph_binary_magic));
+	w.write(header, sizeof(header));
+	w.write(G.adjacency_offsets().data(), G.adjacency_offsets().size() * sizeof(int32_t));
+	w.write(G.adjacency().data(), G.adjacency().size() * sizeof(int32_t));
+	w.flush();
+}
+
+
 std::shared_ptr<std::unordered_set<int>> read_disjoint_paths(const reader &r)
 {
+	input_buffer &in = r.buffered();
 	auto C = std::make_shared<std::unordered_set<int>>();
 	int c;
-	if (r.scan("%d", &c) != 1) throw disjoint_paths_input_exception();
+	if (!in.next_int(c)) throw disjoint_paths_input_exception();
 	for (int i = 0; i < c; i++) {
 		int u;
-		if (r.scan("%d", &u) != 1) throw disjoint_paths_input_exception();
+		if (!in.next_int(u)) throw disjoint_paths_input_exception();
 		C->insert(u);
 	}
 	return C;
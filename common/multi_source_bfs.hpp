@@ -0,0 +1,101 @@
+#ifndef IMPL_MULTI_SOURCE_BFS_HPP
+#define IMPL_MULTI_SOURCE_BFS_HPP
+
+#include <cstdint>
+#include <vector>
+
+
+/**
+ * Fixed-width bitset of W 64-bit words, one bit per BFS lane.
+ * With W = 4 the word loops are meant to be vectorized into 256-bit operations.
+ */
+template<int W>
+struct bit_lanes {
+	static constexpr int size = 64 * W;
+
+	uint64_t w[W] = {};
+
+
+	bool any() const
+	{
+		uint64_t res = 0;
+		for (int i = 0; i < W; i++) res |= w[i];
+		return res != 0;
+	}
+
+
+	void set(int lane)
+	{
+		w[lane / 64] |= uint64_t(1) << (lane % 64);
+	}
+
+
+	bit_lanes & operator|=(const bit_lanes &o)
+	{
+		for (int i = 0; i < W; i++) w[i] |= o.w[i];
+		return *this;
+	}
+
+
+	template<typename F>
+	void for_each(F &&f) const
+	{
+		for (int i = 0; i < W; i++) {
+			for (uint64_t x = w[i]; x; x &= x - 1) {
+				f(64 * i + __builtin_ctzll(x));
+			}
+		}
+	}
+};
+
+
+#ifdef __AVX2__
+typedef bit_lanes<4> default_bit_lanes;
+#else
+typedef bit_lanes<1> default_bit_lanes;
+#endif
+
+
+/**
+ * Runs up to Lanes::size breadth-first searches at once on the unweighted graph G.
+ * Lane i starts from all vertices of lane_sources[i].
+ * Calls on_visit(v, lanes, level) for every vertex v reached by some lanes for the first time at the given level.
+ */
+template<typename Lanes, typename Graph, typename OnVisit>
+void multi_source_bfs(const Graph &G, const std::vector<std::vector<int>> &lane_sources, OnVisit &&on_visit)
+{
+	int n = G.n;
+	thread_local std::vector<Lanes> seen, frontier, next;
+	seen.assign(n, Lanes());
+	frontier.assign(n, Lanes());
+	next.resize(n);
+	for (int i = 0; i < (int) lane_sources.size(); i++) {
+		for (int s : lane_sources[i]) {
+			seen[s].set(i);
+			frontier[s].set(i);
+		}
+	}
+	for (int v = 0; v < n; v++) {
+		if (seen[v].any()) on_visit(v, seen[v], 0);
+	}
+	for (int level = 1; ; level++) {
+		bool any = false;
+		for (int v = 0; v < n; v++) {
+			Lanes acc;
+			for (int u : G.neighbors(v)) acc |= frontier[u];
+			for (int i = 0; i < Lanes::size / 64; i++) acc.w[i] &= ~seen[v].w[i];
+			next[v] = acc;
+			any |= acc.any();
+		}
+		if (!any) return;
+		for (int v = 0; v < n; v++) {
+			frontier[v] = next[v];
+			if (!next[v].any()) continue;
+			seen[v] |= next[v];
+			on_visit(v, next[v], level);
+		}
+	}
+}
+
+
+#endif //IMPL_MULTI_SOURCE_BFS_HPP
@@ -0,0 +1,54 @@
+#ifndef IMPL_PARALLEL_HPP
+#define IMPL_PARALLEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+
+/**
+ * Number of loop iterations that can usefully run at the same time.
+ */
+inline int parallel_width()
+{
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+
+/**
+ * Calls f(0), ..., f(count - 1) on the calling thread and on idle workers of the pool, and returns once all calls finished.
+ * The calling thread takes part in the work, so it is safe to call this from a task running in the same pool:
+ * if no worker is idle, everything simply runs on the caller. At most parallel_width() - 1 helpers are posted.
+ */
+template<typename F>
+void parallel_for(boost::asio::thread_pool &pool, int count, const F &f)
+{
+	struct state {
+		std::atomic<int> next{0};
+		std::mutex mtx;
+		std::condition_variable finished;
+		int cnt_finished = 0;
+	};
+	auto s = std::make_shared<state>();
+	// Helpers that start after all indices were taken return without touching f.
+	auto work = [s, count, &f] () {
+		for (int i = s->next++; i < count; i = s->next++) {
+			f(i);
+			std::lock_guard<std::mutex> lock(s->mtx);
+			if (++s->cnt_finished == count) s->finished.notify_all();
+		}
+	};
+	for (int i = 1; i < std::min(count, parallel_width()); i++) {
+		boost::asio::post(pool, work);
+	}
+	work();
+	std::unique_lock<std::mutex> lock(s->mtx);
+	s->finished.wait(lock, [&s, count] { return s->cnt_finished == count; });
+}
+
+
+#endif //IMPL_PARALLEL_HPP
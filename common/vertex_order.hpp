@@ -0,0 +1,87 @@
+#ifndef IMPL_VERTEX_ORDER_HPP
+#define IMPL_VERTEX_ORDER_HPP
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "graph.hpp"
+
+
+enum class vertex_order {
+	none,
+	bfs,
+	rcm,
+};
+
+
+vertex_order parse_vertex_order(const std::string &value)
+{
+	if (value == "none") return vertex_order::none;
+	if (value == "bfs") return vertex_order::bfs;
+	if (value == "rcm") return vertex_order::rcm;
+	throw invalid_argument_exception("vertex order", value, "Must be one of `none`, `bfs`, `rcm`.");
+}
+
+
+/**
+ * Breadth-first order of all components. With by_degree, components start at a vertex of minimum degree
+ * and neighbors are enqueued by ascending degree (Cuthill-McKee).
+ */
+std::vector<int> breadth_first_order(const graph &G, bool by_degree)
+{
+	std::vector<int> res;
+	res.reserve(G.n);
+	std::vector<int> roots(G.n);
+	for (int u = 0; u < G.n; u++) roots[u] = u;
+	auto degree_less = [&G] (int u, int v) {
+		return G.neighbors(u).size() < G.neighbors(v).size();
+	};
+	if (by_degree) {
+		std::stable_sort(roots.begin(), roots.end(), degree_less);
+	}
+	std::vector<int> visited(G.n, 0);
+	std::vector<int> next;
+	for (int r : roots) {
+		if (visited[r]) continue;
+		visited[r] = 1;
+		res.push_back(r);
+		for (size_t head = res.size() - 1; head < res.size(); head++) {
+			next.clear();
+			for (int v : G.neighbors(res[head])) {
+				if (visited[v]) continue;
+				visited[v] = 1;
+				next.push_back(v);
+			}
+			if (by_degree) {
+				std::stable_sort(next.begin(), next.end(), degree_less);
+			}
+			res.insert(res.end(), next.begin(), next.end());
+		}
+	}
+	return res;
+}
+
+
+/**
+ * Returns order such that order[i] is the original vertex placed at position i, or the identity for vertex_order::none.
+ */
+std::vector<int> locality_order(const graph &G, vertex_order type)
+{
+	switch (type) {
+		case vertex_order::bfs:
+			return breadth_first_order(G, false);
+		case vertex_order::rcm: {
+			auto res = breadth_first_order(G, true);
+			std::reverse(res.begin(), res.end());
+			return res;
+		}
+		default: {
+			std::vector<int> res(G.n);
+			for (int u = 0; u < G.n; u++) res[u] = u;
+			return res;
+		}
+	}
+}
+
+
+#endif //IMPL_VERTEX_ORDER_HPP
@@ -1,4 +1,5 @@
 #include <boost/chrono.hpp>
+#include <optional>
 #include "../common/executor.hpp"
 #include "../common/templates.hpp"
 #include "disjoint_paths.hpp"
@@ -0,0 +1,128 @@
+#ifndef IMPL_CHECKPOINT_HPP
+#define IMPL_CHECKPOINT_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <optional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "../common/common.hpp"
+#include "../common/graph.hpp"
+#include "../common/input.hpp"
+
+
+/**
+ * Tasks of one k round, by their index in the task_source order, that finished without a solution:
+ * all indices below issued except the unfinished ones.
+ */
+struct round_progress {
+	long long issued = 0;
+	std::vector<long long> unfinished;
+};
+
+
+/**
+ * Progress of an exact MESP search that survives a restart.
+ * Every k below k_done is infeasible. best_k and best_path are the best path known so far.
+ */
+struct mesp_checkpoint {
+	uint64_t key = 0;
+	int k_done = 0;
+	std::map<int, round_progress> rounds;
+	int best_k = INF;
+	path best_path;
+
+
+	/**
+	 * Identifies the input, so that a checkpoint is never applied to a different graph or modulator.
+	 */
+	static uint64_t input_key(const graph &G, const std::unordered_set<int> &C)
+	{
+		uint64_t res = G.content_hash();
+		std::vector<int> modulator(C.begin(), C.end());
+		std::sort(modulator.begin(), modulator.end());
+		for (int u : modulator) {
+			res = (res ^ (uint64_t) u) * 1099511628211ull;
+		}
+		return res;
+	}
+
+
+	/**
+	 * Returns nullopt if the file does not exist yet.
+	 */
+	static std::optional<mesp_checkpoint> load(const std::string &filename, uint64_t key)
+	{
+		auto f = std::make_shared<file>(filename, "r");
+		if (f->stream == nullptr) return std::nullopt;
+		reader r(f);
+		mesp_checkpoint res;
+		unsigned long long file_key;
+		int rounds;
+		size_t length;
+		if (r.scan("mesp-checkpoint %llx %d %d %zu", &file_key, &res.k_done, &res.best_k, &length) != 4) {
+			throw invalid_argument_exception("checkpoint", filename, "The file is corrupted.");
+		}
+		if (file_key != key) {
+			throw invalid_argument_exception("checkpoint", filename, "It was written for a different graph or modulator.");
+		}
+		res.key = key;
+		res.best_path.resize(length);
+		for (int &u : res.best_path) {
+			if (r.scan("%d", &u) != 1) throw invalid_argument_exception("checkpoint", filename, "The file is corrupted.");
+		}
+		if (r.scan("%d", &rounds) != 1) throw invalid_argument_exception("checkpoint", filename, "The file is corrupted.");
+		for (int i = 0; i < rounds; i++) {
+			int k;
+			size_t cnt;
+			round_progress p;
+			if (r.scan("%d %lld %zu", &k, &p.issued, &cnt) != 3) throw invalid_argument_exception("checkpoint", filename, "The file is corrupted.");
+			p.unfinished.resize(cnt);
+			for (long long &t : p.unfinished) {
+				if (r.scan("%lld", &t) != 1) throw invalid_argument_exception("checkpoint", filename, "The file is corrupted.");
+			}
+			res.rounds[k] = std::move(p);
+		}
+		return res;
+	}
+
+
+	/**
+	 * Writes a temporary file and renames it, so that a crash or a full disk never leaves a partial checkpoint behind.
+	 */
+	void save(const std::string &filename) const
+	{
+		std::string tmp = filename + ".tmp";
+		auto f = std::make_shared<file>(tmp, "w");
+		if (f->stream == nullptr) {
+			throw open_file_exception(tmp, strerror(errno));
+		}
+		{
+			writer w(f);
+			w.print("mesp-checkpoint %016llx %d %d %zu\n", (unsigned long long) key, k_done, best_k, best_path.size());
+			for (int u : best_path) w.print("%d ", u);
+			w.print("\n%zu\n", rounds.size());
+			for (auto &[k, p] : rounds) {
+				w.print("%d %lld %zu", k, p.issued, p.unfinished.size());
+				for (long long t : p.unfinished) w.print(" %lld", t);
+				w.print("\n");
+			}
+		}
+		if (!f->close()) {
+			int error = errno;
+			remove(tmp.c_str());
+			throw write_file_exception(tmp, strerror(error));
+		}
+		if (rename(tmp.c_str(), filename.c_str()) != 0) {
+			throw open_file_exception(filename, strerror(errno));
+		}
+	}
+};
+
+
+#endif //IMPL_CHECKPOINT_HPP
@@ -1,40 +1,477 @@
 #ifndef IMPL_CONSTRAINED_SET_COVER_HPP
 #define IMPL_CONSTRAINED_SET_COVER_HPP
 
+#include <algorithm>
+#include <boost/asio.hpp>
 #include <boost/dynamic_bitset.hpp>
-#include <functional>
+#include <cstdint>
+#include <optional>
 #include <unordered_map>
 #include <vector>
+#include "../common/parallel.hpp"
 
 
-template <typename Requirement, typename Candidate>
+/**
+ * Set of at most 64 * W requirements as plain words, used instead of boost::dynamic_bitset<> for small instances.
+ */
+template<int W>
+struct coverage_mask {
+	static constexpr int size = 64 * W;
+
+	uint64_t w[W] = {};
+
+
+	static coverage_mask full(int cnt)
+	{
+		coverage_mask res;
+		for (int i = 0; i < cnt; i++) res.set(i);
+		return res;
+	}
+
+
+	static coverage_mask from(const boost::dynamic_bitset<> &bits)
+	{
+		coverage_mask res;
+		for (size_t i = bits.find_first(); i != bits.npos; i = bits.find_next(i)) res.set(i);
+		return res;
+	}
+
+
+	void set(int i)
+	{
+		w[i / 64] |= uint64_t(1) << (i % 64);
+	}
+
+
+	int count() const
+	{
+		int res = 0;
+		for (int i = 0; i < W; i++) res += __builtin_popcountll(w[i]);
+		return res;
+	}
+
+
+	bool is_subset_of(const coverage_mask &o) const
+	{
+		uint64_t res = 0;
+		for (int i = 0; i < W; i++) res |= w[i] & ~o.w[i];
+		return res == 0;
+	}
+
+
+	coverage_mask operator|(const coverage_mask &o) const
+	{
+		coverage_mask res;
+		for (int i = 0; i < W; i++) res.w[i] = w[i] | o.w[i];
+		return res;
+	}
+
+
+	bool operator==(const coverage_mask &o) const
+	{
+		uint64_t res = 0;
+		for (int i = 0; i < W; i++) res |= w[i] ^ o.w[i];
+		return res == 0;
+	}
+
+
+	size_t hash() const
+	{
+		uint64_t res = 0;
+		for (int i = 0; i < W; i++) res = (res ^ w[i]) * 0x9e3779b97f4a7c15ull;
+		// The table uses the low bits, which the multiplication alone leaves poorly mixed.
+		res ^= res >> 33;
+		res *= 0xff51afd7ed558ccdull;
+		return res ^ res >> 33;
+	}
+};
+
+
+/**
+ * dst[e] = src[e] | x for n masks. The word loops are meant to be vectorized.
+ */
+template<int W>
+void or_masks(const coverage_mask<W> *src, int n, const coverage_mask<W> &x, coverage_mask<W> *dst)
+{
+	for (int e = 0; e < n; e++) {
+		for (int i = 0; i < W; i++) dst[e].w[i] = src[e].w[i] | x.w[i];
+	}
+}
+
+
+/**
+ * How a coverage set of some DP layer was reached: the candidate chosen in the previous list
+ * and the index of the step the previous set was reached by. The steps of all layers share one arena,
+ * so earlier layers do not keep their sets alive.
+ */
+struct cover_step {
+	int candidate_id;
+	int parent;
+};
+
+
+/**
+ * Dominance pruning compares all pairs of sets, so larger layers are left as they are.
+ */
+const int dominance_pruning_limit = 4096;
+
+
+/**
+ * The reachable coverage sets of one layer of the set cover DP, each with the index of its step.
+ * Sets are looked up in an open-addressing table with linear probing. clear() keeps the memory,
+ * so the same layers are reused by consecutive calls.
+ */
+template<int W>
+class coverage_layer {
+public:
+	std::vector<coverage_mask<W>> masks;
+	std::vector<int> steps;
+
+private:
+	std::vector<int> slots; // index into masks, -1 if empty; the size is a power of two
+	std::vector<int> order; // scratch space of keep_maximal
+	std::vector<coverage_mask<W>> kept_masks;
+	std::vector<int> kept_steps;
+
+public:
+	/**
+	 * Empties the layer. A table much larger than the last content needed is released, so that one huge layer
+	 * does not make every later clear() and the memory of the thread pay for it.
+	 */
+	void clear()
+	{
+		size_t needed = table_size(masks.size());
+		masks.clear();
+		steps.clear();
+		if (slots.size() > 8 * needed) {
+			std::vector<int>(needed, -1).swap(slots);
+		} else {
+			std::fill(slots.begin(), slots.end(), -1);
+		}
+	}
+
+
+	int size() const
+	{
+		return masks.size();
+	}
+
+
+	/**
+	 * Keeps the first way a set was reached. Returns false if the set was already present.
+	 */
+	bool insert(const coverage_mask<W> &mask, int step)
+	{
+		if (2 * (masks.size() + 1) > slots.size()) grow();
+		size_t s = slot_of(mask);
+		if (slots[s] != -1) return false;
+		slots[s] = masks.size();
+		masks.push_back(mask);
+		steps.push_back(step);
+		return true;
+	}
+
+
+	/**
+	 * Returns the step of the set, -1 if it is not present.
+	 */
+	int find(const coverage_mask<W> &mask) const
+	{
+		if (slots.empty()) return -1;
+		int i = slots[slot_of(mask)];
+		return i == -1 ? -1 : steps[i];
+	}
+
+
+	/**
+	 * Drops every set that is a proper subset of another one in the layer, unless the layer is too large.
+	 */
+	void keep_maximal()
+	{
+		if (masks.size() > dominance_pruning_limit) return;
+		order.resize(masks.size());
+		for (int i = 0; i < order.size(); i++) order[i] = i;
+		std::sort(order.begin(), order.end(), [this] (int a, int b) {
+			return masks[a].count() > masks[b].count();
+		});
+		kept_masks.clear();
+		kept_steps.clear();
+		for (int i : order) {
+			bool dominated = false;
+			for (auto &y : kept_masks) {
+				if (masks[i].is_subset_of(y)) {
+					dominated = true;
+					break;
+				}
+			}
+			if (dominated) continue;
+			kept_masks.push_back(masks[i]);
+			kept_steps.push_back(steps[i]);
+		}
+		masks.swap(kept_masks);
+		steps.swap(kept_steps);
+		rebuild(table_size(masks.size()));
+	}
+
+private:
+	size_t slot_of(const coverage_mask<W> &mask) const
+	{
+		size_t s = mask.hash() & (slots.size() - 1);
+		while (slots[s] != -1 && !(masks[slots[s]] == mask)) {
+			s = (s + 1) & (slots.size() - 1);
+		}
+		return s;
+	}
+
+
+	static size_t table_size(size_t count)
+	{
+		size_t res = 16;
+		while (res < 2 * count) res *= 2;
+		return res;
+	}
+
+
+	void grow()
+	{
+		rebuild(std::max<size_t>(16, 2 * slots.size()));
+	}
+
+
+	void rebuild(size_t slot_count)
+	{
+		slots.assign(slot_count, -1);
+		for (int i = 0; i < masks.size(); i++) {
+			slots[slot_of(masks[i])] = i;
+		}
+	}
+};
+
+
+/**
+ * Moves the steps of a layer, which all lie in arena from first on, to the front of that range and drops the rest,
+ * so that the steps of sets removed by keep_maximal() do not stay in the arena.
+ */
+template<int W>
+void compact_steps(coverage_layer<W> &layer, std::vector<cover_step> &arena, int first)
+{
+	if (layer.size() == arena.size() - first) return;
+	thread_local std::vector<int> order;
+	order.resize(layer.size());
+	for (int i = 0; i < order.size(); i++) order[i] = i;
+	std::sort(order.begin(), order.end(), [&layer] (int a, int b) {
+		return layer.steps[a] < layer.steps[b];
+	});
+	int end = first;
+	for (int i : order) {
+		arena[end] = arena[layer.steps[i]];
+		layer.steps[i] = end++;
+	}
+	arena.resize(end);
+}
+
+
+/**
+ * Every chunk of a parallel expansion gets at least this many (set, candidate) pairs.
+ */
+const long long parallel_expansion_threshold = 1 << 15;
+
+
+/**
+ * Number of chunks an expansion of the given number of (set, candidate) pairs is split into.
+ * Less than 2 means that the expansion is not worth splitting.
+ */
+inline int expansion_chunks(long long pairs)
+{
+	return (int) std::min<long long>(parallel_width(), pairs / parallel_expansion_threshold);
+}
+
+
+/**
+ * Computes next = { r | coverage[j] : r in current, j in candidates } in parallel.
+ * The longer of current and candidates is split into chunk_count ranges, every range is expanded into its own table,
+ * and the tables are merged into next in order.
+ */
+template<int W>
+void expand_layer_parallel(
+		boost::asio::thread_pool &pool,
+		int chunk_count,
+		const coverage_layer<W> &current,
+		const coverage_mask<W> *coverage,
+		int candidate_count,
+		coverage_layer<W> &next,
+		std::vector<cover_step> &arena
+) {
+	struct chunk {
+		coverage_layer<W> layer;
+		std::vector<cover_step> steps;
+	};
+	bool by_candidate = current.size() < candidate_count;
+	int length = by_candidate ? candidate_count : current.size();
+	std::vector<chunk> chunks(chunk_count);
+	parallel_for(pool, chunk_count, [&] (int c) {
+		int begin = (long long) length * c / chunk_count;
+		int end = (long long) length * (c + 1) / chunk_count;
+		int sets_begin = by_candidate ? 0 : begin;
+		int sets_end = by_candidate ? current.size() : end;
+		std::vector<coverage_mask<W>> reached(sets_end - sets_begin);
+		for (int j = by_candidate ? begin : 0; j < (by_candidate ? end : candidate_count); j++) {
+			or_masks(current.masks.data() + sets_begin, sets_end - sets_begin, coverage[j], reached.data());
+			for (int e = sets_begin; e < sets_end; e++) {
+				if (chunks[c].layer.insert(reached[e - sets_begin], chunks[c].steps.size())) {
+					chunks[c].steps.push_back({j, current.steps[e]});
+				}
+			}
+		}
+	});
+	for (auto &c : chunks) {
+		for (int e = 0; e < c.layer.size(); e++) {
+			if (next.insert(c.layer.masks[e], arena.size())) {
+				arena.push_back(c.steps[c.layer.steps[e]]);
+			}
+		}
+	}
+}
+
+
+/**
+ * Follows the parents from the given step of layer last back to the empty set.
+ * Lists after layer last get their first candidate, because everything is covered already.
+ */
+inline std::optional<std::vector<int>> cover_choice(const std::vector<cover_step> &arena, int step, int last, int list_count)
+{
+	std::vector<int> res_candidate_id(list_count, 0);
+	for (int i = last; i > 0; i--) {
+		res_candidate_id[i - 1] = arena[step].candidate_id;
+		step = arena[step].parent;
+	}
+	return res_candidate_id;
+}
+
+
+/**
+ * Set cover DP over fixed-width masks, for at most 64 * W requirements.
+ * The coverage of every candidate is computed once, before the DP.
+ * Only the current and the next layer keep their sets; the steps to reconstruct the choice go to an arena.
+ * With keep_maximal, every layer of at most dominance_pruning_limit sets keeps only the sets
+ * that are not contained in another one, which preserves the answer because coverage only grows along the layers.
+ */
+template <int W, typename Requirement, typename Candidate, typename Psi>
+std::optional<std::vector<int>> constrained_set_cover_masks(
+		const std::vector<Requirement> &requirements,
+		const std::vector<std::vector<Candidate>> &candidates,
+		const Psi &psi,
+		bool keep_maximal,
+		boost::asio::thread_pool *pool
+) {
+	thread_local coverage_layer<W> current, next;
+	thread_local std::vector<cover_step> arena;
+	thread_local std::vector<coverage_mask<W>> coverage, reached;
+	thread_local std::vector<int> list_start;
+	coverage.clear();
+	list_start.assign(1, 0);
+	for (auto &list : candidates) {
+		for (auto &c : list) coverage.push_back(coverage_mask<W>::from(psi(c)));
+		list_start.push_back(coverage.size());
+	}
+
+	auto full = coverage_mask<W>::full(requirements.size());
+	current.clear();
+	arena.clear();
+	current.insert(coverage_mask<W>(), arena.size());
+	arena.push_back({-1, -1});
+	int last = 0;
+	while (last < candidates.size() && current.find(full) == -1) {
+		next.clear();
+		int layer_start = arena.size();
+		const coverage_mask<W> *covered = coverage.data() + list_start[last];
+		int chunk_count = pool == nullptr ? 1 : expansion_chunks((long long) current.size() * candidates[last].size());
+		if (chunk_count > 1) {
+			expand_layer_parallel(*pool, chunk_count, current, covered, candidates[last].size(), next, arena);
+		} else {
+			reached.resize(current.size());
+			for (int j = 0; j < candidates[last].size(); j++) {
+				or_masks(current.masks.data(), current.size(), covered[j], reached.data());
+				for (int e = 0; e < current.size(); e++) {
+					if (next.insert(reached[e], arena.size())) {
+						arena.push_back({j, current.steps[e]});
+					}
+				}
+			}
+		}
+		if (keep_maximal) {
+			next.keep_maximal();
+			compact_steps(next, arena, layer_start);
+		}
+		std::swap(current, next);
+		last++;
+	}
+
+	int step = current.find(full);
+	if (step == -1) return std::nullopt;
+	for (int i = last; i < candidates.size(); i++) {
+		if (candidates[i].empty()) return std::nullopt;
+	}
+	return cover_choice(arena, step, last, candidates.size());
+}
+
+
+/**
+ * Chooses one candidate from each list so that every requirement is satisfied by some chosen candidate,
+ * where psi(c) returns the boost::dynamic_bitset<> of requirements satisfied by c. Returns the chosen index in each list.
+ * Large layers of instances with at most 256 requirements are expanded on the pool, if one is given.
+ */
+template <typename Requirement, typename Candidate, typename Psi>
 std::optional<std::vector<int>> constrained_set_cover(
 		const std::vector<Requirement> &requirements,
 		const std::vector<std::vector<Candidate>> &candidates,
-		const std::function<boost::dynamic_bitset<>(const Candidate &)> &psi
+		const Psi &psi,
+		bool keep_maximal = true,
+		boost::asio::thread_pool *pool = nullptr
 ) {
-	struct satisfied_by {
-		int candidate_id;
-		boost::dynamic_bitset<> prev;
-	};
-	std::vector<std::unordered_map<boost::dynamic_bitset<>, satisfied_by>> D(candidates.size() + 1);
-	D[0] = {{boost::dynamic_bitset<>(requirements.size()), {-1, boost::dynamic_bitset<>()}}};
+	if (requirements.size() <= coverage_mask<1>::size) {
+		return constrained_set_cover_masks<1>(requirements, candidates, psi, keep_maximal, pool);
+	} else if (requirements.size() <= coverage_mask<2>::size) {
+		return constrained_set_cover_masks<2>(requirements, candidates, psi, keep_maximal, pool);
+	} else if (requirements.size() <= coverage_mask<4>::size) {
+		return constrained_set_cover_masks<4>(requirements, candidates, psi, keep_maximal, pool);
+	}
+
+	std::vector<std::vector<boost::dynamic_bitset<>>> coverage(candidates.size());
+	for (int i = 0; i < candidates.size(); i++) {
+		for (auto &c : candidates[i]) coverage[i].push_back(psi(c));
+	}
+	std::vector<cover_step> arena = {{-1, -1}};
+	std::unordered_map<boost::dynamic_bitset<>, int> current = {{boost::dynamic_bitset<>(requirements.size()), 0}};
 	for (int i = 0; i < candidates.size(); i++) {
+		std::unordered_map<boost::dynamic_bitset<>, int> next;
 		for (int j = 0; j < candidates[i].size(); j++) {
-			for (auto [r, _] : D[i]) {
-				D[i + 1][r | psi(candidates[i][j])] = {j, r};
+			auto &covered = coverage[i][j];
+			for (auto &[r, step] : current) {
+				if (next.emplace(r | covered, arena.size()).second) {
+					arena.push_back({j, step});
+				}
 			}
 		}
+		if (keep_maximal && next.size() <= dominance_pruning_limit) {
+			for (auto it = next.begin(); it != next.end(); ) {
+				bool dominated = false;
+				for (auto &[r, _] : next) {
+					if (r != it->first && it->first.is_subset_of(r)) {
+						dominated = true;
+						break;
+					}
+				}
+				it = dominated ? next.erase(it) : std::next(it);
+			}
+		}
+		current = std::move(next);
 	}
-	std::vector<int> res_candidate_id(candidates.size());
 	boost::dynamic_bitset<> R;
 	R.resize(requirements.size(), 1);
-	for (int i = candidates.size(); i > 0; i--) {
-		if (!D[i].count(R)) return std::nullopt;
-		res_candidate_id[i - 1] = D[i][R].candidate_id;
-		R = D[i][R].prev;
-	}
-	return res_candidate_id;
+	auto it = current.find(R);
+	if (it == current.end()) return std::nullopt;
+	return cover_choice(arena, it->second, candidates.size(), candidates.size());
 }
 
 
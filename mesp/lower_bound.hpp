@@ -0,0 +1,55 @@
+#ifndef IMPL_LOWER_BOUND_HPP
+#define IMPL_LOWER_BOUND_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <functional>
+#include "../common/common.hpp"
+#include "../common/graph.hpp"
+
+
+/**
+ * Lower bound on the minimum eccentricity of a shortest path, computed from the distance matrix.
+ *
+ * A shortest a-b path is at distance at least (d(u, a) + d(u, b) - d(a, b)) / 2 from every vertex u,
+ * so the eccentricity of any shortest path is at least the minimum over all pairs (a, b)
+ * of the rounded-up half of graph::max_detour(a, b). Pairs are swept in parallel by their first vertex
+ * and each sweep stops as soon as it cannot improve the best pair found so far.
+ *
+ * Returns 0 if the graph has no distance matrix, or if stop() returned true before all pairs were swept:
+ * the minimum over part of the pairs bounds nothing.
+ */
+int mesp_lower_bound(const graph &G, boost::asio::thread_pool &pool, const std::function<bool()> &stop = [] { return false; })
+{
+	if (!G.has_distance_matrix()) return 0;
+	std::atomic<int> best(INF);
+	std::atomic<bool> stopped(false);
+	boost::mutex mtx;
+	boost::condition_variable finished;
+	int cnt_finished = 0;
+	for (int a = 0; a < G.n; a++) {
+		post(pool, [&G, a, &stop, &best, &stopped, &mtx, &finished, &cnt_finished] () {
+			for (int b = a; b < G.n && !stopped; b++) {
+				if ((b - a) % 256 == 0 && stop()) {
+					stopped = true;
+					break;
+				}
+				if (G.distance(a, b) == -1) continue;
+				int current = best;
+				int detour = G.max_detour(a, b, current - 1);
+				while (detour < current && !best.compare_exchange_weak(current, detour)) {}
+			}
+			boost::mutex::scoped_lock lock(mtx);
+			if (++cnt_finished == G.n) finished.notify_one();
+		});
+	}
+	boost::mutex::scoped_lock lock(mtx);
+	finished.wait(lock, [&cnt_finished, &G] { return cnt_finished == G.n; });
+	if (stopped) return 0;
+	return best == INF ? 0 : (best + 1) / 2;
+}
+
+
+#endif //IMPL_LOWER_BOUND_HPP
@@ -3,6 +3,7 @@
 #include "../common/input.hpp"
 #include "../common/executor.hpp"
 #include "../common/templates.hpp"
+#include "../common/vertex_order.hpp"
 #include "mesp_multithread.hpp"
 
 using boost::asio::thread_pool;
@@ -22,12 +23,22 @@ protected:
 	void print_usage() const override {
 		out->print(
 			"Usage: " + cmd_name() + " [<options>...] [<graph-file> <disjoint-paths-file>]\n"
+			"   or: " + cmd_name() + " convert <graph-file> <binary-graph-file>\n"
 			"Finds the minimum eccentricity shortest path in a given graph.\n"
 			"If no <graph-file> and <disjoint-paths-file> are provided, attempts to read from stdin.\n"
+			"The convert command stores a graph in a binary format which loads faster and is accepted as <graph-file>.\n"
 			"\n"
 			"Options:\n"
 			"  -j <jobs>, --parallel <jobs>\t\tUse <jobs> threads. Default value is 8.\n"
+			"  --distance-cache <dir>\t\tReuse all-pairs distances stored in <dir> and store new ones there.\n"
+			"  --apsp <backend>\t\t\tAll-pairs distances backend: `auto`, `bfs` or `bit-parallel`. Default value is `auto`.\n"
+			"  --time-limit <seconds>\t\tStop after <seconds> and output the best path found together with the proven bounds.\n"
+			"  --checkpoint <file>\t\t\tStore the search progress in <file> and resume from it if it exists.\n"
+			"  --approx\t\t\t\tOnly run the fast approximation; the reported eccentricity is an upper bound.\n"
+			"  --speculate <rounds>\t\t\tEvaluate up to <rounds> consecutive values of k at the same time. Default value is 1.\n"
 			"  -o <file>, --output <file>\t\tWrite the solution to <file> instead of stdout.\n"
+			"  --distance-memory <MiB>\t\tDo not precompute all distances, cache BFS rows in at most <MiB> megabytes instead.\n"
+			"  --reorder <order>\t\t\tRelabel vertices for memory locality: `none`, `bfs` or `rcm`. Default value is `none`.\n"
 			"\n"
 			"Input graph format:\n" +
 			graph_format_desc() + "\n"
@@ -45,7 +56,19 @@ protected:
 			return EXIT_SUCCESS;
 		}
 
+		if (args[1] == "convert") {
+			return convert();
+		}
+
 		optional<string> threads_count;
+		optional<string> speculate;
+		bool approx = false;
+		optional<string> time_limit;
+		optional<string> checkpoint;
+		optional<string> apsp;
+		optional<string> distance_cache;
+		optional<string> reorder;
+		optional<string> distance_memory;
 		optional<string> output_filename;
 		optional<string> graph_filename;
 		optional<string> dp_filename;
@@ -53,6 +76,22 @@ protected:
 		for (size_t i = 1; i < args.size(); i++) {
 			if (args[i] == "-j" || args[i] == "--parallel") {
 				threads_count = args[++i];
+			} else if (args[i] == "--distance-cache") {
+				distance_cache = args[++i];
+			} else if (args[i] == "--apsp") {
+				apsp = args[++i];
+			} else if (args[i] == "--time-limit") {
+				time_limit = args[++i];
+			} else if (args[i] == "--checkpoint") {
+				checkpoint = args[++i];
+			} else if (args[i] == "--approx") {
+				approx = true;
+			} else if (args[i] == "--speculate") {
+				speculate = args[++i];
+			} else if (args[i] == "--distance-memory") {
+				distance_memory = args[++i];
+			} else if (args[i] == "--reorder") {
+				reorder = args[++i];
 			} else if (args[i] == "-o" || args[i] == "--output") {
 				output_filename = args[++i];
 			} else if (!graph_filename.has_value()) {
@@ -80,6 +119,61 @@ protected:
 			}
 		}
 
+		apsp_backend backend = apsp_backend::automatic;
+		if (apsp.has_value()) {
+			backend = parse_apsp_backend(*apsp);
+		}
+
+		if (distance_cache.has_value()) {
+			try {
+				boost::filesystem::create_directories(*distance_cache);
+			} catch (boost::filesystem::filesystem_error &e) {
+				throw open_file_exception(*distance_cache, e.what());
+			}
+		}
+
+		vertex_order order_type = vertex_order::none;
+		if (reorder.has_value()) {
+			order_type = parse_vertex_order(*reorder);
+		}
+
+		mesp_options options;
+		if (speculate.has_value()) {
+			try {
+				options.speculative_rounds = std::stoi(*speculate);
+			} catch (std::exception &e) {
+				throw invalid_argument_exception("rounds", *speculate, "Must be a positive integer.");
+			}
+			if (options.speculative_rounds <= 0) {
+				throw invalid_argument_exception("rounds", *speculate, "Must be a positive integer.");
+			}
+		}
+		if (time_limit.has_value()) {
+			try {
+				options.time_limit = std::stod(*time_limit);
+			} catch (std::exception &e) {
+				throw invalid_argument_exception("time limit", *time_limit, "Must be a positive number.");
+			}
+			if (*options.time_limit <= 0) {
+				throw invalid_argument_exception("time limit", *time_limit, "Must be a positive number.");
+			}
+		}
+		options.checkpoint = checkpoint;
+
+		optional<size_t> oracle_budget;
+		if (distance_memory.has_value()) {
+			int mib;
+			try {
+				mib = std::stoi(*distance_memory);
+			} catch (std::exception &e) {
+				throw invalid_argument_exception("distance memory", *distance_memory, "Must be a positive integer.");
+			}
+			if (mib <= 0) {
+				throw invalid_argument_exception("distance memory", *distance_memory, "Must be a positive integer.");
+			}
+			oracle_budget = (size_t) mib << 20;
+		}
+
 		auto graph_input = in;
 		if (graph_filename.has_value()) {
 			graph_input = make_shared<reader>(open(*graph_filename, "r"));
@@ -99,24 +193,73 @@ protected:
 		auto G = read_graph(*graph_input);
 		auto C = read_disjoint_paths(*dp_input);
 
+		auto order = locality_order(*G, order_type);
+		if (order_type != vertex_order::none) {
+			G = G->relabeled(order);
+			std::vector<int> new_id(G->n);
+			for (int i = 0; i < G->n; i++) new_id[order[i]] = i;
+			auto relabeled_C = make_shared<std::unordered_set<int>>();
+			for (int u : *C) relabeled_C->insert(new_id[u]);
+			C = relabeled_C;
+		}
+
 		auto time0 = system_clock::now();
 		thread_pool pool(threads);
-		G->calculate_distances();
+		mesp_solution solution;
+		if (approx) {
+			solution = approximate_mesp(*G);
+			out->print_tty("Approximate MESP found for k = %d.\n", solution.k);
+		} else {
+			if (oracle_budget.has_value()) {
+				G->use_distance_oracle(*oracle_budget);
+			} else if (distance_cache.has_value()) {
+				G->calculate_distances(pool, backend, *distance_cache);
+			} else {
+				G->calculate_distances(pool, backend);
+			}
 
-		auto solution = mesp_multithread(G, C, pool, [this, time0] (int k, double percent) {
-			double duration_sec = (double) duration_cast<milliseconds>(system_clock::now() - time0).count() / 1000;
-			out->print_tty("\rk = %d\t%6.2f %%\t%.2f s", k, percent, duration_sec);
-		});
+			solution = mesp_multithread(G, C, pool, [this, time0] (int k, double percent) {
+				double duration_sec = (double) duration_cast<milliseconds>(system_clock::now() - time0).count() / 1000;
+				out->print_tty("\rk = %d\t%6.2f %%\t%.2f s", k, percent, duration_sec);
+			}, options);
 
-		out->print_tty("\n\nMESP found for k = %d.\n", solution.k);
+			if (solution.optimal) {
+				out->print_tty("\n\nMESP found for k = %d.\n", solution.k);
+			} else {
+				out->print_tty("\n\nTime limit reached. The best path found has k = %d, the optimum is at least %d.\n", solution.k, solution.k_lower);
+			}
+			for (auto [k, pruned] : solution.pruned_pairs) {
+				out->print_tty("k = %d: %lld endpoint pairs pruned by the distance bound.\n", k, pruned);
+			}
+			for (auto [k, pruned] : solution.pruned_assignments) {
+				out->print_tty("k = %d: %lld partial e assignments pruned by branch and bound.\n", k, pruned);
+			}
+			if (auto cache = G->distance_cache()) {
+				out->print_tty("Distance cache: %lld hits, %lld misses, %zu rows.\n", cache->hits(), cache->misses(), cache->capacity());
+			}
+		}
 		if (sol == out) out->print("\n");
 		sol->print("%zu %d\n", solution.P.size(), solution.k);
-		for (int u : solution.P) sol->print("%d ", u);
+		for (int u : solution.P) sol->print("%d ", order[u]);
 		sol->print("\n");
+		sol->flush();
 
 		pool.join();
 		return EXIT_SUCCESS;
 	}
+
+
+	int convert() const {
+		if (args.size() < 4) {
+			throw missing_arguments_exception();
+		}
+		if (args.size() > 4) {
+			throw unknown_argument_exception(args[4]);
+		}
+		auto G = read_graph(reader(open(args[2], "rb")));
+		write_graph_binary(*G, writer(open(args[3], "wb")));
+		return EXIT_SUCCESS;
+	}
 };
 
 
@@ -1,15 +1,21 @@
 #ifndef IMPL_MESP_INNER_HPP
 #define IMPL_MESP_INNER_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <boost/chrono.hpp>
 #include <boost/dynamic_bitset.hpp>
-#include <queue>
+#include <mutex>
 #include <stack>
-#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include "../common/common.hpp"
 #include "../common/graph.hpp"
+#include "../common/parallel.hpp"
 #include "constrained_set_cover.hpp"
+#include "modulator.hpp"
+#include "segment_cache.hpp"
 
 
 class mesp_inner {
@@ -17,198 +23,338 @@ public:
 	int k;
 	int pi_first, pi_last;
 	std::shared_ptr<const graph> G;
-	std::shared_ptr<const std::unordered_set<int>> C;
+	std::shared_ptr<const modulator> C;
 	path solution;
 
 private:
-	std::unordered_set<int> L;
+	uint64_t L = 0; // subset of the modulator by index; pi_first and pi_last belong to L implicitly
 	std::vector<int> pi;
-	std::unordered_map<int, int> e;
+	std::vector<int> e; // by modulator index, 0 for members of L
+	std::vector<int> e_order; // modulator indices outside of L, in the order search_e assigns them
+	std::vector<int> estimate; // estimate_path_dst of every vertex for the current e
+	std::vector<int> estimate_cnt; // number of terms attaining the estimate
+	std::shared_ptr<segment_cache> cache;
+	std::vector<std::shared_ptr<const segment_cache::segments>> segments; // between consecutive vertices of pi
+	std::vector<std::vector<const path *>> candidates; // segments with more than one choice
+	std::vector<int> h_inv; // index into candidates for every segment, -1 if it has a single choice
+	std::vector<int> I_dst;
+	std::vector<int> I;
+	std::vector<char> in_I;
+	std::vector<char> in_U;
+	const std::atomic<bool> *cancelled = nullptr;
+	const std::atomic<bool> *solved_elsewhere = nullptr; // set by the part of a split task that found a solution
+	boost::asio::thread_pool *pool = nullptr;
+	long long cnt_pruned = 0;
 
 public:
-	mesp_inner(const std::shared_ptr<const graph> &G, const std::shared_ptr<const std::unordered_set<int>> &C, int k, int pi_first = -1, int pi_last = -1):
+	mesp_inner(
+		const std::shared_ptr<const graph> &G,
+		const std::shared_ptr<const modulator> &C,
+		const std::shared_ptr<segment_cache> &cache,
+		int k,
+		int pi_first = -1,
+		int pi_last = -1
+	):
 		G(G),
 		C(C),
+		cache(cache),
 		k(k),
 		pi_first(pi_first),
 		pi_last(pi_last)
 	{}
 
 
+	/**
+	 * Makes solve() give up once the flag is set. The flag must outlive the call to solve().
+	 */
+	void cancel_when(const std::atomic<bool> &flag)
+	{
+		cancelled = &flag;
+	}
+
+
+	/**
+	 * Lets idle workers of the pool take over subsets L of this task and parts of large set cover instances.
+	 */
+	void share_work_with(boost::asio::thread_pool &pool)
+	{
+		this->pool = &pool;
+	}
+
+
 	bool solve()
 	{
 		init_L();
+		auto time0 = boost::chrono::steady_clock::now();
 		do {
-			init_pi();
-			do {
-				if (!can_pi()) continue;
-				init_e();
-				do {
-					if (solve_inner()) return true;
-				} while (next_e());
-			} while (next_pi());
-		} while (next_L());
-		return false;
+			if (solve_L()) return true;
+			if (is_cancelled()) return false;
+			if (!next_L()) return false;
+		} while (!worth_splitting(time0));
+		return solve_parallel();
+	}
+
+
+	/**
+	 * Number of partial e assignments whose subtrees were cut off by branch and bound.
+	 */
+	long long pruned_assignments() const
+	{
+		return cnt_pruned;
 	}
 
 
 private:
-	bool solve_inner()
+	/**
+	 * A task that is still running after the delay and has at least this many subsets L left
+	 * is split into ranges of subsets that idle workers can take. Quick tasks never pay for the split.
+	 */
+	static constexpr uint64_t parallel_subsets_threshold = 64;
+	static constexpr uint64_t parallel_subsets_chunks = 256;
+	static constexpr boost::chrono::milliseconds parallel_split_delay{20};
+
+
+	bool worth_splitting(boost::chrono::steady_clock::time_point time0) const
 	{
-		auto candidate_segments = get_segments();
-		if (!candidate_segments.has_value()) return false;
-		std::unordered_set<int> I(L.begin(), L.end());
-		std::vector<int> h_inv((*candidate_segments).size(), -1);
-		std::vector<std::vector<path>> candidates;
-		for (int i = 0; i < candidate_segments->size(); i++) {
-			if ((*candidate_segments)[i].size() == 1) {
-				for (int u : (*candidate_segments)[i][0]) I.insert(u);
-				continue;
+		if (pool == nullptr || parallel_width() < 2) return false;
+		if (((1ull << C->size()) - 1) - L + 1 < parallel_subsets_threshold) return false;
+		return boost::chrono::steady_clock::now() - time0 >= parallel_split_delay;
+	}
+
+
+	bool is_cancelled() const
+	{
+		return (cancelled != nullptr && cancelled->load(std::memory_order_relaxed)) ||
+			(solved_elsewhere != nullptr && solved_elsewhere->load(std::memory_order_relaxed));
+	}
+
+
+	/**
+	 * Splits the subsets L from the current one to the full modulator into consecutive ranges.
+	 * Every range is solved by its own copy of this task on the calling thread or on an idle worker,
+	 * and the first solution found stops the others.
+	 */
+	bool solve_parallel()
+	{
+		uint64_t first = L;
+		uint64_t subsets = ((1ull << C->size()) - 1) - first + 1;
+		int chunks = std::min(subsets, parallel_subsets_chunks);
+		std::atomic<bool> solved{false};
+		std::atomic<long long> pruned{0};
+		std::mutex mtx;
+		path found; // this task is copied by every range, so it is left untouched until all ranges returned
+		const mesp_inner &task = *this;
+		parallel_for(*pool, chunks, [&] (int c) {
+			if (solved || is_cancelled()) return;
+			mesp_inner part(task);
+			part.solved_elsewhere = &solved;
+			uint64_t begin = first + subsets / chunks * c + std::min<uint64_t>(c, subsets % chunks);
+			uint64_t end = begin + subsets / chunks + (c < subsets % chunks);
+			for (part.L = begin; part.L < end; part.L++) {
+				if (part.L_size() < 2) continue;
+				if (part.solve_L()) {
+					std::lock_guard<std::mutex> lock(mtx);
+					if (!solved) {
+						found = std::move(part.solution);
+						solved = true;
+					}
+					break;
+				}
+				if (part.is_cancelled()) break;
 			}
-			candidates.emplace_back(std::move((*candidate_segments)[i]));
-			h_inv[i] = candidates.size() - 1;
+			pruned += part.cnt_pruned;
+		});
+		cnt_pruned += pruned;
+		if (solved) solution = std::move(found);
+		return solved;
+	}
+
+
+	/**
+	 * Tries all orders pi of the current subset L.
+	 */
+	bool solve_L()
+	{
+		init_pi();
+		do {
+			if (!can_pi()) continue;
+			if (!init_segments()) continue;
+			init_e();
+			if (search_e(0)) return true;
+			if (is_cancelled()) return false;
+		} while (next_pi());
+		return false;
+	}
+
+
+	bool in_L(int u) const
+	{
+		if (u == pi_first || u == pi_last) return true;
+		int i = C->index_of(u);
+		return i != -1 && (L >> i & 1);
+	}
+
+
+	int L_size() const
+	{
+		return __builtin_popcountll(L) + (pi_first != -1) + (pi_last != -1);
+	}
+
+
+	void add_to_I(int u)
+	{
+		if (in_I[u]) return;
+		in_I[u] = 1;
+		I.push_back(u);
+	}
+
+
+	/**
+	 * Depth-first search over e, assigning the free modulator vertices in order.
+	 * Unassigned entries stay at 1, so the estimates are lower bounds for every completion,
+	 * and increasing an entry never makes can_extend() true again.
+	 */
+	bool search_e(int depth)
+	{
+		if (e_order.empty() && !can_extend()) {
+			cnt_pruned++;
+			return false;
+		}
+		if (depth == e_order.size()) return solve_inner();
+		int i = e_order[depth];
+		for (int value = 1; value <= k; value++) {
+			if (value > 1) set_e(i, value);
+			if (is_cancelled()) break;
+			if ((value > 1 || depth == 0) && !can_extend()) {
+				cnt_pruned++;
+				break;
+			}
+			if (search_e(depth + 1)) return true;
 		}
+		set_e(i, 1);
+		return false;
+	}
+
+
+	/**
+	 * Necessary conditions of solve_inner() that only get worse as the estimates grow.
+	 */
+	bool can_extend() const
+	{
+		int U_size = 0;
+		for (int v = 0; v < G->n; v++) {
+			if (C->contains(v) || in_I[v]) continue;
+			if (estimate[v] > k + 1) return false;
+			if (estimate[v] == k + 1) U_size++;
+		}
+		if (U_size > 2 * (pi.size() - 1)) return false;
+		for (auto &Sigma : segments) {
+			int K_size = 0;
+			for (auto &segment : Sigma->paths) {
+				int K_added = 0;
+				for (int j = 1; j < segment.size() && K_added < 2; j++) {
+					if (estimate[segment[j]] > k) K_added++;
+				}
+				K_size += K_added;
+				if (K_size > 4) return false;
+			}
+		}
+		return true;
+	}
 
-		std::unordered_set<int> U;
+
+	/**
+	 * Expects can_extend() to hold for the current e.
+	 */
+	bool solve_inner()
+	{
+		in_U.assign(G->n, 0);
 		for (int v = 0; v < G->n; v++) {
-			if (C->count(v) || I.count(v)) continue;
-			if (estimate_path_dst(v) > k + 1) return false;
-			if (estimate_path_dst(v) == k + 1) U.insert(v);
+			if (C->contains(v) || in_I[v]) continue;
+			if (estimate[v] == k + 1) in_U[v] = 1;
 		}
-		if (U.size() > 2 * (pi.size() - 1)) return false;
 
 		std::vector<int> requirements;
 		for (int u = 0; u < G->n; u++) {
-			if (L.count(u)) continue;
-			if (!C->count(u) && !U.count(u)) continue;
-			int need_dst = e.count(u) ? e[u] : k;
-			if (G->distance(u, I) <= need_dst) continue;
+			if (in_L(u)) continue;
+			if (!C->contains(u) && !in_U[u]) continue;
+			int need_dst = need_distance(u);
+			if (I_dst[u] <= need_dst) continue;
 			requirements.push_back(u);
 		}
-		const std::function<boost::dynamic_bitset<>(const path &)> psi = [this, &requirements] (const path &segment) {
+		auto psi = [this, &requirements] (const path *segment) {
 			boost::dynamic_bitset<> res(requirements.size(), 0);
-			if (segment.empty()) return res;
+			if (segment->empty()) return res;
 			for (int i = 0; i < requirements.size(); i++) {
 				int u = requirements[i];
-				int need_dst = e.count(u) ? e[u] : k;
-				if (G->distance(u, segment) <= need_dst) {
+				int need_dst = need_distance(u);
+				if (G->distance(u, *segment) <= need_dst) {
 					res[i] = true;
 				}
 			}
 			return res;
 		};
-		auto true_segment_id = constrained_set_cover(requirements, candidates, psi);
+		auto true_segment_id = constrained_set_cover(requirements, candidates, psi, true, pool);
 		if (!true_segment_id.has_value()) return false;
 
 		solution.clear();
 		for (int i = 0; i < pi.size() - 1; i++) {
 			solution.push_back(pi[i]);
-			path &segment = h_inv[i] == -1 ? (*candidate_segments)[i][0] : candidates[h_inv[i]][(*true_segment_id)[h_inv[i]]];
+			const path &segment = h_inv[i] == -1 ? segments[i]->paths[0] : *candidates[h_inv[i]][(*true_segment_id)[h_inv[i]]];
 			for (int s : segment) solution.push_back(s);
 		}
 		solution.push_back(pi.back());
-		return G->ecc(solution) <= k;
+		return G->ecc_at_most(solution, k);
 	}
 
 
-	std::optional<std::vector<std::vector<path>>> get_segments() const
+	/**
+	 * Looks up the candidate shortest paths between consecutive vertices of pi avoiding the rest of the modulator.
+	 * They do not depend on e, so the vertices I that every solution contains and their distances
+	 * are computed here once per pi.
+	 */
+	bool init_segments()
 	{
-		std::vector<std::vector<path>> candidate_segments(pi.size() - 1);
+		segments.resize(pi.size() - 1);
 		for (int i = 0; i < pi.size() - 1; i++) {
-			std::queue<int> q;
-			q.push(pi[i + 1]);
-			std::unordered_map<int, int> dst = {{pi[i + 1], 0}};
-			while (!q.empty()) {
-				int u = q.front();
-				q.pop();
-				if (u == pi[i]) break;
-				for (int v : G->neighbors(u)) {
-					if (dst.count(v)) continue;
-					if (C->count(v) && v != pi[i]) continue;
-					dst[v] = dst[u] + 1;
-					q.push(v);
-				}
-			}
-			if (!dst.count(pi[i])) return std::nullopt;
-			if (dst[pi[i]] != G->distance(pi[i + 1], pi[i])) return std::nullopt;
-			std::vector<path> Sigma;
-			std::vector<int> K;
-			for (int u : G->neighbors(pi[i])) {
-				if (!dst.count(u) || dst[u] != dst[pi[i]] - 1) continue;
-				if (u == pi[i + 1]) {
-					Sigma.emplace_back();
-					break;
-				}
-				for (int v : G->neighbors(u)) {
-					if (!dst.count(v) || dst[v] != dst[u] - 1) continue;
-					Sigma.push_back({u});
-					int K_added = 0;
-					while (v != pi[i + 1]) {
-						int p = Sigma.back().back();
-						if (estimate_path_dst(v) > k) {
-							if (K_added++ < 2) K.push_back(v);
-							if (K.size() > 4) return std::nullopt;
-						}
-						Sigma.back().push_back(v);
-						for (int n : G->neighbors(v)) {
-							if (!dst.count(n) || dst[n] != dst[v] - 1) continue;
-							if (n == p) continue;
-							v = n;
-							break;
-						}
-					}
-				}
-			}
-			for (auto &segment : Sigma) {
-				std::vector<int> K_sat(K.size(), 0);
-				for (int j = 0; j < K.size(); j++) {
-					K_sat[j] |= G->distance(K[j], segment) <= k;
-				}
-				bool is_sat = true;
-				for (bool s : K_sat) is_sat |= s;
-				if (is_sat) {
-					candidate_segments[i].emplace_back(std::move(segment));
-				}
+			segments[i] = cache->get(pi[i], pi[i + 1]);
+			if (!segments[i]->reachable) return false;
+		}
+
+		I.clear();
+		in_I.assign(G->n, 0);
+		for (int u : pi) add_to_I(u);
+		h_inv.assign(segments.size(), -1);
+		candidates.clear();
+		for (int i = 0; i < segments.size(); i++) {
+			auto &Sigma = segments[i]->paths;
+			if (Sigma.size() == 1) {
+				for (int u : Sigma[0]) add_to_I(u);
+				continue;
 			}
+			candidates.emplace_back();
+			for (auto &segment : Sigma) candidates.back().push_back(&segment);
+			h_inv[i] = candidates.size() - 1;
 		}
-		return candidate_segments;
+		G->distance_to_set(I, I_dst);
+		return true;
 	}
 
 
 	void init_L()
 	{
-		L.clear();
-		auto C_iter = C->begin();
-		if (pi_first == -1) {
-			L.insert(*C_iter);
-			++C_iter;
-		} else {
-			L.insert(pi_first);
-		}
-		if (pi_last == -1) {
-			L.insert(*C_iter);
-		} else {
-			L.insert(pi_last);
-		}
+		L = 0;
+		if (pi_first == -1) L |= 1;
+		if (pi_last == -1) L |= pi_first == -1 ? 2 : 1;
 	}
 
 
 	bool next_L()
 	{
-		int max_size = C->size();
-		if (pi_first != -1) max_size++;
-		if (pi_last != -1) max_size++;
-		if (L.size() == max_size) return false;
+		if (L == (1ull << C->size()) - 1) return false;
 		do {
-			for (int v : *C) {
-				if (L.count(v)) {
-					L.erase(v);
-				} else {
-					L.insert(v);
-					break;
-				}
-			}
-		} while (L.size() < 2);
+			L++;
+		} while (L_size() < 2);
 		return true;
 	}
 
@@ -216,11 +362,10 @@ private:
 	void init_pi()
 	{
 		pi.clear();
-		pi.reserve(L.size());
+		pi.reserve(L_size());
 		if (pi_first != -1) pi.push_back(pi_first);
-		for (int u : L) {
-			if (u == pi_first || u == pi_last) continue;
-			pi.push_back(u);
+		for (uint64_t rest = L; rest != 0; rest &= rest - 1) {
+			pi.push_back(C->vertices[__builtin_ctzll(rest)]);
 		}
 		if (pi_last != -1) pi.push_back(pi_last);
 		std::sort(pi.begin() + (pi_first == -1 ? 0 : 1), pi.end() - (pi_last == -1 ? 0 : 1));
@@ -261,45 +406,84 @@ private:
 
 	void init_e()
 	{
-		e.clear();
-		for (int v : *C) {
-			if (L.count(v)) continue;
-			e[v] = 1;
+		e.assign(C->size(), 0);
+		e_order.clear();
+		for (int i = 0; i < C->size(); i++) {
+			if (L >> i & 1) continue;
+			e[i] = 1;
+			e_order.push_back(i);
+		}
+		estimate.resize(G->n);
+		estimate_cnt.resize(G->n);
+		for (int u = 0; u < G->n; u++) {
+			recount_estimate(u);
 		}
 	}
 
 
-	bool next_e()
+	/**
+	 * Changes entry i of e and updates the estimates of all vertices from that entry alone.
+	 */
+	void set_e(int i, int value)
 	{
+		if (e[i] == value) return;
+		int old_value = e[i];
+		e[i] = value;
+		int c = C->vertices[i];
+		for (int u = 0; u < G->n; u++) {
+			int term = G->distance(c, u) + value;
+			if (value < old_value) {
+				if (term < estimate[u]) {
+					estimate[u] = term;
+					estimate_cnt[u] = 1;
+				} else if (term == estimate[u]) {
+					estimate_cnt[u]++;
+				}
+			} else if (term - value + old_value == estimate[u] && --estimate_cnt[u] == 0) {
+				recount_estimate(u);
+			}
+		}
+	}
+
+
+	/**
+	 * Computes estimate_path_dst(u) from scratch, together with the number of terms attaining it.
+	 */
+	void recount_estimate(int u)
+	{
+		int res = INF;
 		int cnt = 0;
-		for (int v : *C) {
-			if (L.count(v)) continue;
-			if (e[v] < k) {
-				e[v]++;
-				break;
-			} else {
-				e[v] = 1;
+		auto add = [&res, &cnt] (int term) {
+			if (term < res) {
+				res = term;
+				cnt = 1;
+			} else if (term == res) {
 				cnt++;
 			}
+		};
+		if (pi_first != -1) add(G->distance(u, pi_first));
+		if (pi_last != -1) add(G->distance(u, pi_last));
+		for (int i = 0; i < C->size(); i++) {
+			add(G->distance(C->vertices[i], u) + e[i]);
 		}
-		return cnt < e.size();
+		estimate[u] = res;
+		estimate_cnt[u] = cnt;
+	}
+
+
+	/**
+	 * Distance that the path must reach u from, given the current guess of e.
+	 */
+	int need_distance(int u) const
+	{
+		int i = C->index_of(u);
+		return i == -1 ? k : e[i];
 	}
 
 
 	int estimate_path_dst(int u) const
 	{
-		int res = INF;
-		if (pi_first != -1) {
-			res = std::min(res, G->distance(u, pi_first));
-		}
-		if (pi_last != -1) {
-			res = std::min(res, G->distance(u, pi_last));
-		}
-		for (int v : *C) {
-			int e_v = e.count(v) ? e.at(v) : 0;
-			res = std::min(res, G->distance(u, v) + e_v);
-		}
-		return res;
+		return estimate[u];
 	}
 
 };
@@ -1,11 +1,21 @@
 #ifndef IMPL_MESP_H
 #define IMPL_MESP_H
 
+#include <algorithm>
+#include <atomic>
 #include <boost/asio.hpp>
 #include <boost/thread.hpp>
+#include <deque>
 #include <functional>
+#include <limits>
+#include <optional>
+#include <set>
+#include <string>
 #include <unordered_set>
+#include <utility>
 #include <vector>
+#include "checkpoint.hpp"
+#include "lower_bound.hpp"
 #include "mesp_inner.hpp"
 
 
@@ -38,102 +48,578 @@ std::optional<path> check_path(const graph &G)
 }
 
 
+/**
+ * Shortest s-t path found by BFS, or an empty path if t is not reachable from s.
+ */
+path shortest_path(const graph &G, int s, int t)
+{
+	std::vector<int> parent(G.n, -1);
+	std::vector<int> queue = {s};
+	parent[s] = s;
+	for (size_t head = 0; head < queue.size() && parent[t] == -1; head++) {
+		for (int v : G.neighbors(queue[head])) {
+			if (parent[v] != -1) continue;
+			parent[v] = queue[head];
+			queue.push_back(v);
+		}
+	}
+	path res;
+	if (parent[t] == -1) return res;
+	for (int u = t; u != s; u = parent[u]) res.push_back(u);
+	res.push_back(s);
+	std::reverse(res.begin(), res.end());
+	return res;
+}
+
+
+/**
+ * Last vertex reached by a BFS from s, i.e. a vertex farthest from s.
+ */
+int farthest_vertex(const graph &G, int s)
+{
+	std::vector<int> visited(G.n, 0);
+	std::vector<int> queue = {s};
+	visited[s] = 1;
+	for (size_t head = 0; head < queue.size(); head++) {
+		for (int v : G.neighbors(queue[head])) {
+			if (visited[v]) continue;
+			visited[v] = 1;
+			queue.push_back(v);
+		}
+	}
+	return queue.back();
+}
+
+
 struct mesp_solution {
 	int k;
 	path P;
+	int k_lower = 0; // proven lower bound: where the search started, or the first unfinished round if stopped early
+	std::vector<std::pair<int, long long>> pruned_pairs; // (k, endpoint pairs skipped by the detour bound) per finished round
+	std::vector<std::pair<int, long long>> pruned_assignments; // (k, partial e assignments cut off by branch and bound) per finished round
+	bool optimal = true; // false if the time limit expired; then k_lower <= optimum <= k
 };
 
 
+struct mesp_options {
+	int speculative_rounds = 1; // how many k rounds may run at the same time; the result does not depend on it
+	std::optional<double> time_limit; // seconds, after which the best known bounds are returned
+	std::optional<std::string> checkpoint; // file to resume the search from and to store its progress in
+};
+
+
+/**
+ * Polynomial approximation: a shortest path between the ends of a BFS double sweep.
+ * Such a path has eccentricity within a constant factor of the optimum. The sweep is repeated from the far end
+ * a few times and the best path is kept; the result is always a valid shortest path with its exact eccentricity.
+ * The eccentricities of all sweep paths are computed together by the bit-parallel BFS.
+ */
+mesp_solution approximate_mesp(const graph &G, int sweeps = 4)
+{
+	if (G.n == 0) return {0, {}};
+	if (auto P = check_path(G)) {
+		return {0, *P};
+	}
+	std::vector<path> candidates;
+	int x = farthest_vertex(G, 0);
+	for (int i = 0; i < sweeps; i++) {
+		int y = farthest_vertex(G, x);
+		candidates.push_back(shortest_path(G, x, y));
+		if (y == x) break;
+		x = y;
+	}
+	auto k = G.ecc(candidates);
+	int best = std::min_element(k.begin(), k.end()) - k.begin();
+	return {k[best], std::move(candidates[best])};
+}
+
+
 mesp_solution mesp_multithread(
 	const std::shared_ptr<const graph> &G,
 	const std::shared_ptr<const std::unordered_set<int>> &C,
 	boost::asio::thread_pool &pool,
-	const std::function<void(int, double)> &report_progress = [](int, double) {}
+	const std::function<void(int, double)> &report_progress = [](int, double) {},
+	const mesp_options &options = {}
 ) {
 	class threads_status {
 	private:
 		boost::mutex mtx;
-		int cnt_finished = 0;
+		boost::condition_variable changed;
+		long long cnt_finished = 0;
+		long long cnt_pruned = 0;
+		long long cnt_pruned_assignments = 0;
+		std::atomic<bool> solved{false};
+		std::atomic<bool> stopped{false};
 		std::optional<path> solution;
 
 	public:
 		void report_solution(path &&s) {
 			boost::mutex::scoped_lock lock(mtx);
 			cnt_finished++;
-			if (solution.has_value()) return;
-			solution = std::move(s);
+			if (!solution.has_value()) {
+				solution = std::move(s);
+				solved = true;
+				stopped = true;
+			}
+			changed.notify_all();
 		}
 
 		void report_no_solution() {
 			boost::mutex::scoped_lock lock(mtx);
 			cnt_finished++;
+			changed.notify_all();
+		}
+
+		void report_pruned(long long cnt) {
+			boost::mutex::scoped_lock lock(mtx);
+			cnt_finished += cnt;
+			cnt_pruned += cnt;
+			changed.notify_all();
+		}
+
+		long long pruned() {
+			boost::mutex::scoped_lock lock(mtx);
+			return cnt_pruned;
+		}
+
+		void report_pruned_assignments(long long cnt) {
+			boost::mutex::scoped_lock lock(mtx);
+			cnt_pruned_assignments += cnt;
+		}
+
+		long long pruned_assignments() {
+			boost::mutex::scoped_lock lock(mtx);
+			return cnt_pruned_assignments;
 		}
 
 		bool is_solved() const {
-			return solution.has_value();
+			return solved;
 		}
 
-		int attempts() const {
+		/**
+		 * Stops handing out tasks of this round, used once a lower round is solved.
+		 */
+		void cancel() {
+			stopped = true;
+		}
+
+		bool is_stopped() const {
+			return stopped;
+		}
+
+		const std::atomic<bool> & stopped_flag() const {
+			return stopped;
+		}
+
+		long long attempts() {
+			boost::mutex::scoped_lock lock(mtx);
 			return cnt_finished;
 		}
 
+		/**
+		 * Waits until all attempts finished or a solution is reported, or until the timeout expires.
+		 * Returns true in the former case.
+		 */
+		bool wait_for(long long attempts, const boost::chrono::milliseconds &timeout) {
+			boost::mutex::scoped_lock lock(mtx);
+			return changed.wait_for(lock, timeout, [this, attempts] {
+				return cnt_finished >= attempts || solution.has_value();
+			});
+		}
+
 		std::vector<int> && get_solution() {
 			return move(*solution);
 		}
+
+		std::optional<path> peek_solution() {
+			boost::mutex::scoped_lock lock(mtx);
+			return solution;
+		}
+	};
+
+
+	struct task {
+		long long index;
+		std::pair<int, int> ends;
+	};
+
+
+	/**
+	 * Generates the (pi_first, pi_last) pairs of one k round lazily, in the order they used to be posted.
+	 * The pair (u, -1) stands for a path ending in the modulator, (-1, -1) for both ends in the modulator.
+	 * Tracks the tasks in progress, so that progress() describes exactly the finished ones.
+	 * A source resumed from a checkpoint only hands out the tasks the checkpoint does not list as finished.
+	 */
+	class task_source {
+	private:
+		boost::mutex mtx;
+		std::vector<int> free;
+		bool two_in_modulator;
+		bool started = false;
+		int i = 0;
+		int j = 0;
+		round_progress resumed;
+		std::set<long long> redo;
+		long long issued = 0;
+		std::set<long long> running;
+
+	public:
+		task_source(const graph &G, const std::unordered_set<int> &C, const round_progress &resumed = {}):
+			two_in_modulator(C.size() >= 2),
+			resumed(resumed),
+			redo(resumed.unfinished.begin(), resumed.unfinished.end())
+		{
+			for (int u = 0; u < G.n; u++) {
+				if (!C.count(u)) free.push_back(u);
+			}
+		}
+
+		long long size() const {
+			long long r = free.size();
+			return (two_in_modulator ? 1 + r : 0) + r * (r - 1) / 2;
+		}
+
+		/**
+		 * Number of tasks finished by a previous run.
+		 */
+		long long skipped() const {
+			return std::min<long long>(resumed.issued, size()) - redo.size();
+		}
+
+		std::optional<task> next() {
+			boost::mutex::scoped_lock lock(mtx);
+			while (true) {
+				auto ends = advance();
+				if (!ends.has_value()) return std::nullopt;
+				long long index = issued - 1;
+				if (index < resumed.issued && !redo.count(index)) continue;
+				running.insert(index);
+				return task{index, *ends};
+			}
+		}
+
+		void finish(long long index) {
+			boost::mutex::scoped_lock lock(mtx);
+			running.erase(index);
+		}
+
+		/**
+		 * Tasks that are not in progress any more were finished without a solution, unless the round was stopped.
+		 */
+		round_progress progress() {
+			boost::mutex::scoped_lock lock(mtx);
+			round_progress res;
+			res.issued = issued;
+			res.unfinished.assign(running.begin(), running.end());
+			if (issued < resumed.issued) {
+				res.issued = resumed.issued;
+				for (long long t : redo) {
+					if (t >= issued) res.unfinished.push_back(t);
+				}
+			}
+			return res;
+		}
+
+	private:
+		std::optional<std::pair<int, int>> advance() {
+			issued++;
+			if (!started) {
+				started = true;
+				if (two_in_modulator) return std::make_pair(-1, -1);
+			}
+			while (i < free.size()) {
+				if (j == i) {
+					j++;
+					if (two_in_modulator) return std::make_pair(free[i], -1);
+				}
+				if (j < free.size()) return std::make_pair(free[i], free[j++]);
+				i++;
+				j = i;
+			}
+			issued--;
+			return std::nullopt;
+		}
 	};
 
 
+	/**
+	 * Window of k rounds evaluated at the same time. Tasks are handed out from the lowest round
+	 * that still has some, so higher rounds only use workers that the lower ones leave idle.
+	 */
+	class scheduler {
+	public:
+		struct round {
+			int k;
+			std::shared_ptr<threads_status> status;
+			std::shared_ptr<task_source> source;
+		};
+
+		struct job {
+			int k;
+			std::shared_ptr<threads_status> status;
+			std::shared_ptr<task_source> source;
+			task t;
+		};
+
+	private:
+		boost::mutex mtx;
+		std::deque<round> rounds;
+		int active_consumers = 0;
+
+	public:
+		void open(const round &r) {
+			boost::mutex::scoped_lock lock(mtx);
+			rounds.push_back(r);
+		}
+
+		void close_lowest() {
+			boost::mutex::scoped_lock lock(mtx);
+			rounds.pop_front();
+		}
+
+		std::optional<round> lowest() {
+			boost::mutex::scoped_lock lock(mtx);
+			if (rounds.empty()) return std::nullopt;
+			return rounds.front();
+		}
+
+		std::vector<round> open_rounds() {
+			boost::mutex::scoped_lock lock(mtx);
+			return {rounds.begin(), rounds.end()};
+		}
+
+		void cancel_all() {
+			cancel_above(std::numeric_limits<int>::min());
+		}
+
+		bool any_solved() {
+			boost::mutex::scoped_lock lock(mtx);
+			for (auto &r : rounds) {
+				if (r.status->is_solved()) return true;
+			}
+			return false;
+		}
+
+		void cancel_above(int k) {
+			boost::mutex::scoped_lock lock(mtx);
+			for (auto &r : rounds) {
+				if (r.k > k) r.status->cancel();
+			}
+		}
+
+		/**
+		 * Returns how many consumers to post so that max_consumers of them are active.
+		 */
+		int reserve_consumers(int max_consumers) {
+			boost::mutex::scoped_lock lock(mtx);
+			int res = std::max(0, max_consumers - active_consumers);
+			active_consumers += res;
+			return res;
+		}
+
+		/**
+		 * Next task of the lowest round that has one. When there is none, the calling consumer retires.
+		 */
+		std::optional<job> next() {
+			boost::mutex::scoped_lock lock(mtx);
+			for (auto &r : rounds) {
+				if (r.status->is_stopped()) continue;
+				auto t = r.source->next();
+				if (t.has_value()) return job{r.k, r.status, r.source, *t};
+			}
+			active_consumers--;
+			return std::nullopt;
+		}
+	};
+
+
+	/**
+	 * Runs one task from the scheduler and posts itself again, so that the pool queue stays bounded.
+	 */
 	class consumer {
 	private:
-		std::shared_ptr<threads_status> current_status;
-		mesp_inner inner;
+		std::shared_ptr<scheduler> tasks;
+		std::shared_ptr<const graph> G;
+		std::shared_ptr<const modulator> C;
+		std::shared_ptr<segment_cache> segments;
+		boost::asio::thread_pool *pool;
 
 	public:
-		consumer(const std::shared_ptr<threads_status> &current_status, mesp_inner &&inner) :
-				current_status(current_status),
-				inner(std::move(inner)) {}
+		consumer(
+			const std::shared_ptr<scheduler> &tasks,
+			const std::shared_ptr<const graph> &G,
+			const std::shared_ptr<const modulator> &C,
+			const std::shared_ptr<segment_cache> &segments,
+			boost::asio::thread_pool &pool
+		) :
+				tasks(tasks),
+				G(G),
+				C(C),
+				segments(segments),
+				pool(&pool) {}
 
 		void operator()() {
-			if (current_status->is_solved()) return;
-			if (inner.solve()) {
-				current_status->report_solution(move(inner.solution));
-			} else {
-				current_status->report_no_solution();
+			std::optional<typename scheduler::job> task;
+			while ((task = tasks->next()).has_value() && can_prune(*task)) {
+				task->status->report_pruned(1);
+				task->source->finish(task->t.index);
+			}
+			if (!task.has_value()) return;
+			mesp_inner inner(G, C, segments, task->k, task->t.ends.first, task->t.ends.second);
+			inner.cancel_when(task->status->stopped_flag());
+			inner.share_work_with(*pool);
+			bool solved = inner.solve();
+			task->status->report_pruned_assignments(inner.pruned_assignments());
+			if (solved) {
+				task->status->report_solution(move(inner.solution));
+				task->source->finish(task->t.index);
+				tasks->cancel_above(task->k);
+			} else if (!task->status->is_stopped()) {
+				task->status->report_no_solution();
+				task->source->finish(task->t.index);
 			}
+			post(*pool, *this);
+		}
+
+	private:
+		/**
+		 * Every vertex u is at distance at least (d(u, a) + d(u, b) - d(a, b)) / 2 from a shortest a-b path.
+		 */
+		bool can_prune(const typename scheduler::job &task) const {
+			auto [a, b] = task.t.ends;
+			if (a == -1 || b == -1 || !G->has_distance_matrix()) return false;
+			return G->max_detour(a, b, 2 * task.k) > 2 * task.k;
 		}
 	};
 
+	const int max_in_flight = 256;
+
+	auto time0 = boost::chrono::steady_clock::now();
+	auto expired = [&options, time0] () {
+		if (!options.time_limit.has_value()) return false;
+		return boost::chrono::duration<double>(boost::chrono::steady_clock::now() - time0).count() >= *options.time_limit;
+	};
+
 	auto path = check_path(*G);
 	if (path.has_value()) {
 		return {0, *path};
 	}
+	auto M = std::make_shared<const modulator>(*G, *C);
+	auto segments = std::make_shared<segment_cache>(G, M);
+
+	auto approx = approximate_mesp(*G);
+	int k_lower = std::max(1, mesp_lower_bound(*G, pool, expired));
+	std::optional<mesp_checkpoint> progress;
+	if (options.checkpoint.has_value()) {
+		uint64_t key = mesp_checkpoint::input_key(*G, *C);
+		progress = mesp_checkpoint::load(*options.checkpoint, key);
+		if (!progress.has_value()) {
+			progress = mesp_checkpoint();
+			progress->key = key;
+		}
+		k_lower = std::max(k_lower, progress->k_done);
+		if (progress->best_k < approx.k) {
+			approx.k = progress->best_k;
+			approx.P = progress->best_path;
+		}
+	}
+	if (approx.k <= k_lower) {
+		approx.k_lower = approx.k;
+		return approx;
+	}
+
+	std::vector<std::pair<int, long long>> pruned_pairs;
+	std::vector<std::pair<int, long long>> pruned_assignments;
+	auto tasks = std::make_shared<scheduler>();
+	int next_k = k_lower;
+	auto open_round = [&G, &C, &M, &segments, &pool, &tasks, &next_k, &progress, max_in_flight] () {
+		round_progress resumed;
+		if (progress.has_value() && progress->rounds.count(next_k)) {
+			resumed = progress->rounds[next_k];
+		}
+		auto source = std::make_shared<task_source>(*G, *C, resumed);
+		tasks->open({next_k++, std::make_shared<threads_status>(), source});
+		for (int i = tasks->reserve_consumers(max_in_flight); i > 0; i--) {
+			post(pool, consumer(tasks, G, M, segments, pool));
+		}
+	};
+
+	// Best path known so far and the first round that is not proven infeasible.
+	auto best_known = [&tasks, &approx, &next_k] () {
+		mesp_solution res = approx;
+		auto rounds = tasks->open_rounds();
+		res.k_lower = rounds.empty() ? next_k : rounds.front().k;
+		for (auto &r : rounds) {
+			auto P = r.status->peek_solution();
+			if (!P.has_value() || r.k >= res.k) continue;
+			res.k = r.k;
+			res.P = std::move(*P);
+		}
+		return res;
+	};
+
+	auto save_progress = [&options, &progress, &tasks, &best_known] () {
+		if (!progress.has_value()) return;
+		auto best = best_known();
+		progress->k_done = best.k_lower;
+		progress->best_k = best.k;
+		progress->best_path = best.P;
+		// Rounds that were loaded but not reopened yet keep their progress; only the proven infeasible ones are dropped.
+		progress->rounds.erase(progress->rounds.begin(), progress->rounds.lower_bound(best.k_lower));
+		progress->rounds.erase(progress->rounds.lower_bound(best.k), progress->rounds.end());
+		for (auto &r : tasks->open_rounds()) {
+			progress->rounds[r.k] = r.source->progress();
+		}
+		progress->save(*options.checkpoint);
+	};
 
-	for (int k = 1; k <= G->n; k++) {
-		auto status = std::make_shared<threads_status>();
-		int attempts = 0;
-		if (C->size() >= 2) {
-			post(pool, consumer(status, mesp_inner(G, C, k)));
-			attempts++;
-		}
-		for (int pi_first = 0; pi_first < G->n; pi_first++) {
-			if (C->count(pi_first)) continue;
-			if (C->size() >= 2) {
-				post(pool, consumer(status, mesp_inner(G, C, k, pi_first)));
-				attempts++;
+	auto last_save = boost::chrono::steady_clock::now();
+
+	for (int i = 0; i < std::max(1, options.speculative_rounds) && next_k < approx.k; i++) {
+		open_round();
+	}
+	while (auto current = tasks->lowest()) {
+		long long attempts = current->source->size() - current->source->skipped();
+		while (!current->status->wait_for(attempts, boost::chrono::milliseconds(100))) {
+			report_progress(current->k, 100.0 * current->status->attempts() / attempts);
+			if (expired()) {
+				tasks->cancel_all();
+				save_progress();
+				auto res = best_known();
+				res.pruned_pairs = std::move(pruned_pairs);
+				res.pruned_assignments = std::move(pruned_assignments);
+				res.optimal = res.k <= res.k_lower;
+				return res;
 			}
-			for (int pi_last = pi_first + 1; pi_last < G->n; pi_last++) {
-				if (C->count(pi_last)) continue;
-				post(pool, consumer(status, mesp_inner(G, C, k, pi_first, pi_last)));
-				attempts++;
+			if (boost::chrono::steady_clock::now() - last_save > boost::chrono::seconds(5)) {
+				save_progress();
+				last_save = boost::chrono::steady_clock::now();
+			}
+		}
+		pruned_pairs.emplace_back(current->k, current->status->pruned());
+		pruned_assignments.emplace_back(current->k, current->status->pruned_assignments());
+		if (current->status->is_solved()) {
+			tasks->cancel_above(current->k);
+			mesp_solution res = {current->k, std::move(current->status->get_solution()), k_lower, std::move(pruned_pairs), std::move(pruned_assignments)};
+			if (progress.has_value()) {
+				progress->k_done = progress->best_k = res.k;
+				progress->best_path = res.P;
+				progress->rounds.clear();
+				progress->save(*options.checkpoint);
 			}
+			return res;
 		}
-		while (status->attempts() < attempts && !status->is_solved()) {
-			boost::this_thread::sleep_for(boost::chrono::milliseconds(100));
-			report_progress(k, 100.0 * status->attempts() / attempts);
+		tasks->close_lowest();
+		if (!tasks->any_solved() && next_k < approx.k) {
+			open_round();
 		}
-		if (status->is_solved()) return {k, std::move(status->get_solution())};
+		save_progress();
 	}
-	throw implementation_exception(); // should not reach here
+	save_progress();
+	approx.k_lower = k_lower;
+	approx.pruned_pairs = std::move(pruned_pairs);
+	approx.pruned_assignments = std::move(pruned_assignments);
+	return approx; // every round below the approximation's eccentricity is infeasible
 }
 
 #endif //IMPL_MESP_H
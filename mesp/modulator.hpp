@@ -0,0 +1,57 @@
+#ifndef IMPL_MODULATOR_HPP
+#define IMPL_MODULATOR_HPP
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "../common/exceptions.hpp"
+#include "../common/graph.hpp"
+
+
+/**
+ * The modulator relabeled to 0..|C|-1 (in the iteration order of the input set), with a flat membership array.
+ * Built once per search and shared by all mesp_inner instances.
+ */
+class modulator {
+public:
+	static constexpr int max_size = 63;
+
+	std::vector<int> vertices;
+
+private:
+	std::vector<int> index;
+
+public:
+	modulator(const graph &G, const std::unordered_set<int> &C):
+		vertices(C.begin(), C.end()),
+		index(G.n, -1)
+	{
+		if (vertices.size() > max_size) {
+			throw invalid_argument_exception("modulator size", std::to_string(vertices.size()), "At most 63 vertices are supported.");
+		}
+		for (int i = 0; i < vertices.size(); i++) {
+			index[vertices[i]] = i;
+		}
+	}
+
+
+	int size() const
+	{
+		return vertices.size();
+	}
+
+
+	bool contains(int v) const
+	{
+		return index[v] != -1;
+	}
+
+
+	int index_of(int v) const
+	{
+		return index[v];
+	}
+};
+
+
+#endif //IMPL_MODULATOR_HPP
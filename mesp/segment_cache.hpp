@@ -0,0 +1,125 @@
+#ifndef IMPL_SEGMENT_CACHE_HPP
+#define IMPL_SEGMENT_CACHE_HPP
+
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "../common/common.hpp"
+#include "../common/graph.hpp"
+#include "modulator.hpp"
+
+
+/**
+ * Candidate shortest paths between two vertices that avoid the rest of the modulator.
+ * They depend neither on k nor on e, so a single cache is shared by all tasks of a search.
+ * Entries are computed outside of any lock and kept in independently locked shards
+ * until the memory budget is used up; later pairs are computed on every request.
+ */
+class segment_cache {
+public:
+	struct segments {
+		bool reachable = false; // false if no shortest path between the ends avoids the modulator
+		std::vector<path> paths; // inner vertices only, starting next to the first end
+	};
+
+private:
+	static constexpr int shard_count = 16;
+
+	struct shard {
+		std::mutex mtx;
+		std::unordered_map<long long, std::shared_ptr<const segments>> entries;
+		size_t bytes = 0;
+	};
+
+	std::shared_ptr<const graph> G;
+	std::shared_ptr<const modulator> C;
+	size_t bytes_per_shard;
+	std::unique_ptr<shard[]> shards;
+
+public:
+	segment_cache(const std::shared_ptr<const graph> &G, const std::shared_ptr<const modulator> &C, size_t memory_budget = (size_t) 256 << 20):
+		G(G),
+		C(C),
+		bytes_per_shard(memory_budget / shard_count),
+		shards(new shard[shard_count])
+	{}
+
+
+	/**
+	 * Paths from a to b, where a and b may themselves belong to the modulator.
+	 */
+	std::shared_ptr<const segments> get(int a, int b)
+	{
+		long long key = (long long) a * G->n + b;
+		shard &s = shards[key % shard_count];
+		{
+			std::lock_guard<std::mutex> lock(s.mtx);
+			auto it = s.entries.find(key);
+			if (it != s.entries.end()) return it->second;
+		}
+		auto res = compute(a, b);
+		size_t bytes = sizeof(segments) + 64;
+		for (auto &P : res->paths) bytes += sizeof(path) + P.size() * sizeof(int);
+		std::lock_guard<std::mutex> lock(s.mtx);
+		auto it = s.entries.find(key);
+		if (it != s.entries.end()) return it->second;
+		if (s.bytes + bytes <= bytes_per_shard) {
+			s.bytes += bytes;
+			s.entries[key] = res;
+		}
+		return res;
+	}
+
+
+private:
+	std::shared_ptr<const segments> compute(int a, int b) const
+	{
+		thread_local std::vector<int> dst;
+		thread_local std::vector<int> visited;
+		for (int u : visited) dst[u] = -1;
+		dst.resize(G->n, -1);
+		visited.assign(1, b);
+		dst[b] = 0;
+		for (int head = 0; head < visited.size(); head++) {
+			int u = visited[head];
+			if (u == a) break;
+			for (int v : G->neighbors(u)) {
+				if (dst[v] != -1) continue;
+				if (C->contains(v) && v != a) continue;
+				dst[v] = dst[u] + 1;
+				visited.push_back(v);
+			}
+		}
+
+		auto res = std::make_shared<segments>();
+		if (dst[a] == -1 || dst[a] != G->distance(b, a)) return res;
+		res->reachable = true;
+		std::vector<path> &Sigma = res->paths;
+		for (int u : G->neighbors(a)) {
+			if (dst[u] != dst[a] - 1) continue;
+			if (u == b) {
+				Sigma.emplace_back();
+				break;
+			}
+			for (int v : G->neighbors(u)) {
+				if (dst[v] != dst[u] - 1) continue;
+				Sigma.push_back({u});
+				while (v != b) {
+					int p = Sigma.back().back();
+					Sigma.back().push_back(v);
+					for (int n : G->neighbors(v)) {
+						if (dst[n] != dst[v] - 1) continue;
+						if (n == p) continue;
+						v = n;
+						break;
+					}
+				}
+			}
+		}
+		return res;
+	}
+};
+
+
+#endif //IMPL_SEGMENT_CACHE_HPP
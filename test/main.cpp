@@ -35,6 +35,12 @@ protected:
 			"\n"
 			 "Options:\n"
 			 "  -j <jobs>, --parallel <jobs>\t\tUse <jobs> threads. Default value is 8.\n"
+			 "  --distance-cache <dir>\t\tReuse all-pairs distances stored in <dir> and store new ones there.\n"
+			 "  --apsp <backend>\t\t\tAll-pairs distances backend: `auto`, `bfs` or `bit-parallel`. Default value is `auto`.\n"
+			 "  --binary\t\t\t\tStore every graph in the binary format and load it back before solving.\n"
+			 "  --speculate <rounds>\t\t\tEvaluate up to <rounds> consecutive values of k at the same time.\n"
+			 "  --checkpoint\t\t\t\tSolve every graph with a checkpoint file, then solve it again resumed from that file.\n"
+			 "  --approx\t\t\t\tOnly run the approximation and check that it is a valid upper bound.\n"
 		);
 	}
 
@@ -45,11 +51,29 @@ protected:
 		}
 
 		optional<string> threads_count;
+		optional<string> apsp;
+		optional<string> distance_cache;
+		optional<string> speculate;
+		bool binary = false;
+		bool checkpoint = false;
+		bool approx = false;
 		vector<string> paths;
 
 		for (size_t i = 1; i < args.size(); i++) {
 			if (args[i] == "-j" || args[i] == "--parallel") {
 				threads_count = args[++i];
+			} else if (args[i] == "--distance-cache") {
+				distance_cache = args[++i];
+			} else if (args[i] == "--apsp") {
+				apsp = args[++i];
+			} else if (args[i] == "--binary") {
+				binary = true;
+			} else if (args[i] == "--speculate") {
+				speculate = args[++i];
+			} else if (args[i] == "--checkpoint") {
+				checkpoint = true;
+			} else if (args[i] == "--approx") {
+				approx = true;
 			} else {
 				paths.push_back(args[i]);
 			}
@@ -67,6 +91,40 @@ protected:
 			}
 		}
 
+		apsp_backend backend = apsp_backend::automatic;
+		if (apsp.has_value()) {
+			backend = parse_apsp_backend(*apsp);
+		}
+
+		mesp_options options;
+		if (speculate.has_value()) {
+			try {
+				options.speculative_rounds = std::stoi(*speculate);
+			} catch (std::exception &e) {
+				throw invalid_argument_exception("rounds", *speculate, "Must be a positive integer.");
+			}
+			if (options.speculative_rounds <= 0) {
+				throw invalid_argument_exception("rounds", *speculate, "Must be a positive integer.");
+			}
+		}
+
+		auto scratch_dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+		if (binary || checkpoint) {
+			try {
+				boost::filesystem::create_directories(scratch_dir);
+			} catch (boost::filesystem::filesystem_error &e) {
+				throw open_file_exception(scratch_dir.string(), e.what());
+			}
+		}
+
+		if (distance_cache.has_value()) {
+			try {
+				boost::filesystem::create_directories(*distance_cache);
+			} catch (boost::filesystem::filesystem_error &e) {
+				throw open_file_exception(*distance_cache, e.what());
+			}
+		}
+
 		vector<recursive_directory_iterator> dirs;
 		dirs.reserve(paths.size());
 		for (auto &path : paths) {
@@ -90,14 +148,32 @@ protected:
 				cnt++;
 
 				auto G = read_graph(open(entry.path(), "r"));
-				G->calculate_distances();
+				if (binary) {
+					auto binary_file = (scratch_dir / entry.path().stem() += ".bin").string();
+					write_graph_binary(*G, writer(open(binary_file, "wb")));
+					G = read_graph(reader(open(binary_file, "rb")));
+				}
+				if (distance_cache.has_value()) {
+					G->calculate_distances(pool, backend, *distance_cache);
+				} else {
+					G->calculate_distances(pool, backend);
+				}
 				auto C = modulator_to_disjoint_paths(G);
-				auto mesp = mesp_multithread(G, C, pool);
-				int k = G->ecc(mesp.P);
-
+				mesp_solution mesp;
+				if (approx) {
+					mesp = approximate_mesp(*G);
+				} else if (checkpoint) {
+					mesp_options resumable = options;
+					resumable.checkpoint = (scratch_dir / entry.path().stem() += ".ckpt").string();
+					mesp_multithread(G, C, pool, [] (int, double) {}, resumable);
+					mesp = mesp_multithread(G, C, pool, [] (int, double) {}, resumable);
+				} else {
+					mesp = mesp_multithread(G, C, pool, [] (int, double) {}, options);
+				}
 				bool success = true;
 
-				if (mesp.k != k) {
+				if (!G->ecc_at_most(mesp.P, mesp.k) || (mesp.k > 0 && G->ecc_at_most(mesp.P, mesp.k - 1))) {
+					int k = G->ecc(mesp.P);
 					success = false;
 					errors.push_back(
 						entry.path().string() + "\t\t(reported eccentricity) " + to_string(mesp.k) + " != " +
@@ -114,7 +190,7 @@ protected:
 					int expected;
 					reader r(open(ecc_file, "r"));
 					r.scan("%d", &expected);
-					if (mesp.k != expected) {
+					if (approx ? mesp.k < expected : mesp.k != expected) {
 						success = false;
 						errors.push_back(
 							entry.path().string() + "\t\t(reported eccentricity) " + to_string(mesp.k) + " != " +
@@ -128,10 +204,13 @@ protected:
 					out->print("F");
 					failures++;
 				}
+				out->flush();
 			}
 		}
 
 		pool.join();
+		boost::system::error_code ec;
+		boost::filesystem::remove_all(scratch_dir, ec);
 		double duration_sec = (double) duration_cast<milliseconds>(system_clock::now() - time0).count() / 1000;
 
 		out->print("\n\n");